@@ -17,58 +17,392 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <string.h>
-#define streq(a, b) (!strcmp((a), (b)))
 
-static void stdin_to_stream(char *buf, ssize_t r, FILE *outf) {
+/* Largest chunk to move in one splice() call. */
+#define SPLICE_SIZE (1024 * 1024)
+/* ... and in one copy_file_range() or sendfile() call. */
+#define COPY_SIZE (1024 * 1024 * 1024)
+
+/* Input held back while deciding whether to run the command is kept in
+ * memory up to this size, and spilled to an anonymous file beyond it. */
+#define SPOOL_MEM (1024 * 1024)
+
+struct spool {
+	char *mem;
+	size_t len;
+	int fd;		/* spill file, or -1 */
+	unsigned long long bytes, lines;
+	int last;	/* last byte seen, or -1 */
+};
+
+static void usage(void) {
+	fprintf(stderr, "Usage: ifne [-n] [--min-bytes N] [--min-lines N] "
+			"[--wait T] command [args]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void write_all(int fd, char *buf, ssize_t r) {
+	ssize_t w;
+
 	while (r > 0) {
-		if (fwrite(buf, r*sizeof(char), 1, outf) < 1) {
+		w = write(fd, buf, r);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
 			fprintf(stderr, "Write error\n");
 			exit(EXIT_FAILURE);
 		}
-		r = read(0, buf, BUFSIZ*sizeof(char));
+		buf += w;
+		r -= w;
 	}
-	if (r == -1) {
-		perror("read");
+}
+
+/* Pass everything from infd on to outfd, using whichever kernel copy
+ * fits the file types so the data never enters our address space:
+ * copy_file_range() between regular files, splice() when either end is a
+ * pipe, sendfile() from a regular file to anything else. Each falls back
+ * to the next when the kernel refuses, and finally to read/write. */
+static void copy_fd(int infd, int outfd) {
+	char buf[BUFSIZ];
+	struct stat in, out;
+	int in_reg, in_pipe, out_reg, out_pipe;
+	ssize_t r;
+
+	if (fstat(infd, &in) == -1 || fstat(outfd, &out) == -1) {
+		in_reg = in_pipe = out_reg = out_pipe = 0;
+	} else {
+		in_reg = S_ISREG(in.st_mode) || S_ISBLK(in.st_mode);
+		in_pipe = S_ISFIFO(in.st_mode);
+		out_reg = S_ISREG(out.st_mode);
+		out_pipe = S_ISFIFO(out.st_mode);
+	}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 27)
+	if (in_reg && out_reg) {
+		for (;;) {
+			r = copy_file_range(infd, NULL, outfd, NULL,
+					    COPY_SIZE, 0);
+			if (r > 0)
+				continue;
+			if (r == 0)
+				return;
+			if (errno == EINTR)
+				continue;
+			break;	/* e.g. EXDEV, EINVAL, or an O_APPEND output */
+		}
+	}
+#endif
+#ifdef SPLICE_F_MOVE
+	while (in_pipe || out_pipe) {
+		r = splice(infd, NULL, outfd, NULL, SPLICE_SIZE,
+			   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (r > 0)
+			continue;
+		if (r == 0)
+			return;
+		if (errno == EINTR)
+			continue;
+		if (errno == EINVAL || errno == ENOSYS)
+			break;	/* the other end can't splice */
+		if (errno == EPIPE) {
+			fprintf(stderr, "Write error\n");
+			exit(EXIT_FAILURE);
+		}
+		perror("splice");
 		exit(EXIT_FAILURE);
 	}
+#endif
+#ifdef __linux__
+	while (in_reg) {
+		r = sendfile(outfd, infd, NULL, COPY_SIZE);
+		if (r > 0)
+			continue;
+		if (r == 0)
+			return;
+		if (errno == EINTR)
+			continue;
+		if (errno == EINVAL || errno == ENOSYS)
+			break;
+		if (errno == EPIPE) {
+			fprintf(stderr, "Write error\n");
+			exit(EXIT_FAILURE);
+		}
+		perror("sendfile");
+		exit(EXIT_FAILURE);
+	}
+#endif
+	while ((r = read(infd, buf, sizeof buf)) != 0) {
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		write_all(outfd, buf, r);
+	}
 }
 
-int main(int argc, char **argv) {
+static void count_lines(struct spool *sp, const char *buf, size_t r) {
+	const char *p = buf, *end = buf + r;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		sp->lines++;
+		p++;
+	}
+}
+
+/* Has the input seen so far reached the thresholds? At EOF, a final line
+ * without a newline counts as a line. */
+static int enough(struct spool *sp, unsigned long long min_bytes,
+		  unsigned long long min_lines, int eof) {
+	unsigned long long lines = sp->lines;
+
+	if (eof && sp->last != -1 && sp->last != '\n')
+		lines++;
+	return sp->bytes >= min_bytes && lines >= min_lines;
+}
+
+static void spool_add(struct spool *sp, char *buf, size_t r,
+		      int counting_lines) {
+	if (r == 0)
+		return;
+	sp->bytes += r;
+	sp->last = (unsigned char)buf[r - 1];
+	if (counting_lines)
+		count_lines(sp, buf, r);
+
+	if (sp->fd == -1 && sp->len + r <= SPOOL_MEM) {
+		if (!sp->mem && !(sp->mem = malloc(SPOOL_MEM))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(sp->mem + sp->len, buf, r);
+		sp->len += r;
+		return;
+	}
+	if (sp->fd == -1) {
+#ifdef MFD_CLOEXEC
+		sp->fd = memfd_create("ifne", MFD_CLOEXEC);
+		if (sp->fd == -1)
+#endif
+		{
+			FILE *f = tmpfile();
+			if (!f || (sp->fd = dup(fileno(f))) == -1) {
+				perror("tmpfile");
+				exit(EXIT_FAILURE);
+			}
+			fclose(f);
+		}
+	}
+	write_all(sp->fd, buf, r);
+}
+
+/* Write out everything held in the spool. */
+static void spool_flush(struct spool *sp, int outfd) {
+	write_all(outfd, sp->mem, sp->len);
+	if (sp->fd != -1) {
+		if (lseek(sp->fd, 0, SEEK_SET) == -1) {
+			perror("lseek");
+			exit(EXIT_FAILURE);
+		}
+		copy_fd(sp->fd, outfd);
+		close(sp->fd);
+	}
+}
+
+/* Read stdin into the spool until the thresholds are reached, EOF, or the
+ * wait time (in seconds, if not negative) runs out. Returns nonzero if the
+ * input is to be treated as non-empty. */
+static int fill_spool(struct spool *sp, unsigned long long min_bytes,
+		      unsigned long long min_lines, double wait) {
+	char buf[BUFSIZ];
+	struct timespec start, t;
+	struct pollfd pfd;
 	ssize_t r;
-	int run_if_empty;
+	int timeout = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfd.fd = 0;
+	pfd.events = POLLIN;
+	while (!enough(sp, min_bytes, min_lines, 0)) {
+		if (wait >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			timeout = (wait - (t.tv_sec - start.tv_sec) -
+				   (t.tv_nsec - start.tv_nsec) / 1e9) * 1000;
+			if (timeout < 0)
+				timeout = 0;
+			r = poll(&pfd, 1, timeout);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == 0)
+				return 0;	/* timed out */
+		}
+		r = read(0, buf, sizeof buf);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		if (r == 0)
+			return enough(sp, min_bytes, min_lines, 1);
+		spool_add(sp, buf, r, min_lines > 0);
+	}
+	return 1;
+}
+
+/* If stdin is a regular file or block device, ifne need not stay in the
+ * data path: look ahead from the current position with pread(), which
+ * leaves the file offset alone, and either exit or exec the command on
+ * the original stdin. For -n with input, copy it to stdout straight from
+ * the file. Returns only if stdin is not seekable. */
+static void seekable_stdin(int run_if_empty, char **argv_exec,
+			   unsigned long long min_bytes,
+			   unsigned long long min_lines) {
+	struct spool sp = { NULL, 0, -1, 0, 0, -1 };
+	char buf[BUFSIZ];
+	struct stat st;
+	off_t off;
+	ssize_t r;
+	int nonempty;
+
+	if (fstat(0, &st) == -1 || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)))
+		return;
+	off = lseek(0, 0, SEEK_CUR);
+	if (off == -1)
+		return;
+
+	/* The size is only a hint, as some files (in sysfs, say) claim one
+	 * they do not have: check that there really is data that far in. */
+	if (!min_lines && S_ISREG(st.st_mode) && off < st.st_size &&
+	    (unsigned long long)(st.st_size - off) >= min_bytes &&
+	    (min_bytes == 0 || pread(0, buf, 1, off + min_bytes - 1) == 1))
+		nonempty = 1;
+	else {
+		for (;;) {
+			/* One byte is all the default threshold needs. */
+			r = pread(0, buf, min_bytes > 1 || min_lines ?
+				  sizeof buf : 1, off + sp.bytes);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				return;
+			}
+			if (r == 0) {
+				nonempty = enough(&sp, min_bytes, min_lines, 1);
+				break;
+			}
+			sp.bytes += r;
+			sp.last = (unsigned char)buf[r - 1];
+			count_lines(&sp, buf, r);
+			if (enough(&sp, min_bytes, min_lines, 0)) {
+				nonempty = 1;
+				break;
+			}
+		}
+	}
+
+	if (!nonempty && !run_if_empty)
+		exit(EXIT_SUCCESS);
+	if (nonempty && run_if_empty) {
+		copy_fd(0, 1);
+		exit(EXIT_SUCCESS);
+	}
+
+	execvp(*argv_exec, argv_exec);
+	perror(*argv_exec);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long long parse_count(const char *s) {
+	unsigned long long n;
+	char *end;
+
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	if (errno || end == s || *end || *s == '-') {
+		fprintf(stderr, "ifne: invalid number `%s'\n", s);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	int run_if_empty = 0;
+	unsigned long long min_bytes = 1, min_lines = 0;
+	double wait = -1;
+	char *end;
 	char **argv_exec;
 	int fds[2];
 	int child_status;
 	pid_t child_pid;
-	char buf[BUFSIZ];
-	FILE *outf;
+	struct spool sp = { NULL, 0, -1, 0, 0, -1 };
+	int nonempty;
+	int opt;
+	struct option options[] = {
+		{ "min-bytes", required_argument, NULL, 'b' },
+		{ "min-lines", required_argument, NULL, 'l' },
+		{ "wait", required_argument, NULL, 'w' },
+		{ 0, 0, 0, 0 }
+	};
 
-	if ((argc < 2) || ((argc == 2) && streq(argv[1], "-n"))) {
-		fprintf(stderr, "Usage: ifne [-n] command [args]\n");
-		return EXIT_FAILURE;
+	while ((opt = getopt_long(argc, argv, "+n", options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			run_if_empty = 1;
+			break;
+		case 'b':
+			min_bytes = parse_count(optarg);
+			break;
+		case 'l':
+			min_lines = parse_count(optarg);
+			break;
+		case 'w':
+			wait = strtod(optarg, &end);
+			if (end == optarg || *end || wait < 0) {
+				fprintf(stderr, "ifne: invalid time `%s'\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage();
+		}
 	}
+	if (optind >= argc)
+		usage();
+	argv_exec = &argv[optind];
 
-	if (streq(argv[1], "-n")) {
-		run_if_empty = 1;
-		argv_exec = &argv[2];
-	} else {
-		run_if_empty = 0;
-		argv_exec = &argv[1];
-	}
+	seekable_stdin(run_if_empty, argv_exec, min_bytes, min_lines);
 
-	r = read(0, buf, BUFSIZ*sizeof(char));
+	nonempty = fill_spool(&sp, min_bytes, min_lines, wait);
 
-	if ((r == 0) && !run_if_empty)
+	if (!nonempty && !run_if_empty)
+		return EXIT_SUCCESS;
+
+	if (nonempty && run_if_empty) {
+		/* don't run the subcommand if we read something from stdin and -n was set */
+		/* But write stdin to stdout so ifne -n can be piped without sucking the stream */
+		spool_flush(&sp, 1);
+		copy_fd(0, 1);
 		return EXIT_SUCCESS;
-	else if (r == -1) {
-		perror("read");
-		return EXIT_FAILURE;
 	}
 
 	if (pipe(fds)) {
@@ -76,13 +410,6 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	if (r && run_if_empty) {
-		/* don't run the subcommand if we read something from stdin and -n was set */
-		/* But write stdin to stdout so ifne -n can be piped without sucking the stream */
-		stdin_to_stream(buf, r, stdout);
-		return EXIT_SUCCESS;
-	}
-
 	child_pid = fork();
 	if (!child_pid) {
 		/* child process: rebind stdin and exec the subcommand */
@@ -101,16 +428,11 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	/* Parent: write stdin to fds[1] */
+	/* Parent: write the spooled input, then the rest of stdin, to fds[1] */
 	close(fds[0]);
-	outf = fdopen(fds[1], "w");
-	if (! outf) {
-		perror("fdopen");
-		exit(1);
-	}
-
-	stdin_to_stream(buf, r, outf);
-	fclose(outf);
+	spool_flush(&sp, fds[1]);
+	copy_fd(0, fds[1]);
+	close(fds[1]);
 
 	if (waitpid(child_pid, &child_status, 0) != child_pid) {
 		perror("waitpid");
@@ -0,0 +1,452 @@
+/*
+ * isutf8-bench.c - measure and cross-check the isutf8 validators
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * This includes isutf8.c itself, to get at its static functions. It
+ * generates corpora of various kinds of text, reports how fast each
+ * validator gets through them, and then checks the fast validators
+ * against the reference one on lots of short random inputs.
+ */
+
+#define ISUTF8_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "isutf8.c"
+
+#include <time.h>
+
+
+struct kernel {
+        const char *name;
+        size_t (*scan)(const unsigned char *, size_t);
+        int usable;
+};
+
+static struct kernel kernels[] = {
+        { "scalar", scan_scalar, 1 },
+#ifdef HAVE_X86_SIMD
+        { "sse4.1", scan_sse41, 0 },
+        { "avx2", scan_avx2, 0 },
+#endif
+};
+enum { NKERNELS = sizeof kernels / sizeof kernels[0] };
+
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void)
+{
+        /* xorshift64* */
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+static unsigned long rng_range(unsigned long lo, unsigned long hi)
+{
+        return lo + rng() % (hi - lo + 1);
+}
+
+
+/* A code point the reference validator accepts, of any length. */
+static unsigned long any_code(void)
+{
+        static const unsigned long top[] = {
+                0x7F, 0x7FF, 0xFFFF, 0x1FFFFF, 0x3FFFFFF, 0x7FFFFFFF
+        };
+        unsigned long u;
+
+        do {
+                u = rng_range(0, top[rng() % MAX_UTF8_BYTES]);
+        } while ((u >= 0xD800 && u <= 0xDFFF) || u == 0xFFFE || u == 0xFFFF);
+        return u;
+}
+
+
+static size_t put_code(unsigned char *s, unsigned long u)
+{
+        return encodeutf8(u, s, MAX_UTF8_BYTES);
+}
+
+
+/*
+ * Corpora. Each fills 'n' bytes at 's' with valid UTF-8 and returns how
+ * many it used, which is at most MAX_UTF8_BYTES short of 'n'.
+ */
+static size_t gen_ascii(unsigned char *s, size_t n)
+{
+        size_t i = 0, col = 0;
+
+        while (i + MAX_UTF8_BYTES < n) {
+                if (col > 60 && rng() % 8 == 0) {
+                        s[i++] = '\n';
+                        col = 0;
+                } else {
+                        s[i++] = rng() % 6 ? rng_range('a', 'z') : ' ';
+                        col++;
+                }
+        }
+        return i;
+}
+
+
+static size_t gen_cjk(unsigned char *s, size_t n)
+{
+        size_t i = 0;
+        unsigned r;
+
+        while (i + MAX_UTF8_BYTES < n) {
+                r = rng() % 40;
+                if (r == 0)
+                        s[i++] = '\n';
+                else if (r < 4)
+                        i += put_code(s + i, rng_range(0x3001, 0x3002));
+                else if (r < 8)
+                        s[i++] = rng_range('0', '9');
+                else
+                        i += put_code(s + i, rng_range(0x4E00, 0x9FFF));
+        }
+        return i;
+}
+
+
+static size_t gen_emoji(unsigned char *s, size_t n)
+{
+        size_t i = 0;
+        unsigned r;
+
+        while (i + MAX_UTF8_BYTES < n) {
+                r = rng() % 10;
+                if (r == 0)
+                        s[i++] = rng() % 4 ? ' ' : '\n';
+                else if (r < 4)
+                        s[i++] = rng_range('a', 'z');
+                else
+                        i += put_code(s + i, rng_range(0x1F300, 0x1FAFF));
+        }
+        return i;
+}
+
+
+/* Characters of every length in random order, so that nothing can be
+ * skipped over quickly. */
+static size_t gen_adversarial(unsigned char *s, size_t n)
+{
+        size_t i = 0;
+
+        while (i + MAX_UTF8_BYTES < n)
+                i += put_code(s + i, any_code());
+        return i;
+}
+
+
+static const struct {
+        const char *name;
+        size_t (*gen)(unsigned char *, size_t);
+} corpora[] = {
+        { "ascii", gen_ascii },
+        { "cjk", gen_cjk },
+        { "emoji", gen_emoji },
+        { "adversarial", gen_adversarial },
+};
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static double mbps(size_t n, double secs)
+{
+        return secs > 0 ? n / secs / (1024 * 1024) : 0;
+}
+
+
+static size_t ref_scan_all(const unsigned char *s, size_t n)
+{
+        struct ref_state st;
+        struct utf8_pos pos = { 1, 1, 0 };
+
+        st.nbytes = 0;
+        return ref_scan(&st, &pos, s, n, 1) ? n : 0;
+}
+
+
+/* Best of 'reps' runs, in MB/s; 0 if the validator got it wrong. */
+static double time_scan(size_t (*scan)(const unsigned char *, size_t),
+                        const unsigned char *s, size_t n, int reps)
+{
+        double best = 0, t;
+        int i;
+
+        for (i = 0; i < reps; ++i) {
+                t = now();
+                if (scan(s, n) != n)
+                        return 0;
+                t = now() - t;
+                if (i == 0 || t < best)
+                        best = t;
+        }
+        return mbps(n, best);
+}
+
+
+/* The whole program path: a file, mapped and validated. */
+static double time_stream(const unsigned char *s, size_t n, int reps)
+{
+        char name[] = "/tmp/isutf8-bench.XXXXXX";
+        double best = 0, t;
+        int fd, i, ok = 1;
+
+        fd = mkstemp(name);
+        if (fd == -1) {
+                perror("isutf8-bench: mkstemp");
+                exit(EXIT_FAILURE);
+        }
+        (void) unlink(name);
+        if (write(fd, s, n) != (ssize_t) n) {
+                perror("isutf8-bench: write");
+                exit(EXIT_FAILURE);
+        }
+        choose_scanner();
+        for (i = 0; i < reps && ok; ++i) {
+                (void) lseek(fd, 0, SEEK_SET);
+                t = now();
+                ok = is_utf8_byte_stream(fd, name, 1);
+                t = now() - t;
+                if (i == 0 || t < best)
+                        best = t;
+        }
+        (void) close(fd);
+        return ok ? mbps(n, best) : 0;
+}
+
+
+static void bench(size_t size, int reps)
+{
+        unsigned char *s;
+        size_t n, c;
+        int k;
+
+        s = malloc(size);
+        if (s == NULL) {
+                fprintf(stderr, "isutf8-bench: out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+
+        printf("%-12s %8s %8s", "MB/s", "ref", "stream");
+        for (k = 0; k < NKERNELS; ++k)
+                printf(" %8s", kernels[k].name);
+        printf("\n");
+
+        for (c = 0; c < sizeof corpora / sizeof corpora[0]; ++c) {
+                n = corpora[c].gen(s, size);
+                printf("%-12s %8.0f %8.0f", corpora[c].name,
+                       time_scan(ref_scan_all, s, n, 1),
+                       time_stream(s, n, reps));
+                for (k = 0; k < NKERNELS; ++k) {
+                        if (kernels[k].usable)
+                                printf(" %8.0f", time_scan(kernels[k].scan,
+                                                           s, n, reps));
+                        else
+                                printf(" %8s", "-");
+                }
+                printf("\n");
+                fflush(stdout);
+        }
+        free(s);
+}
+
+
+/* A short input made of valid characters and assorted bad bytes. */
+static size_t gen_fuzz(unsigned char *s, size_t max)
+{
+        static const char *const bad[] = {
+                "\x80", "\xbf", "\xc0\x80", "\xc1\xbf", "\xc2", "\xe2\x82",
+                "\xed\xa0\x80", "\xed\xbf\xbf", "\xef\xbf\xbe", "\xef\xbf\xbf",
+                "\xe0\x9f\xbf", "\xf0\x8f\xbf\xbf", "\xf8\x87\xbf\xbf\xbf",
+                "\xfc\x83\xbf\xbf\xbf\xbf", "\xfe", "\xff", "\x80\x80\x80",
+                "\xfd\xbf\xbf\xbf\xbf\xbf\xbf",
+        };
+        const char *b;
+        size_t i = 0, len, target;
+        unsigned r;
+
+        target = rng_range(0, max - 8);
+        while (i < target) {
+                r = rng() % 100;
+                if (r < 40) {
+                        len = rng_range(1, 40);
+                        if (len > max - 8 - i)
+                                len = max - 8 - i;
+                        memset(s + i, r % 2 ? 'a' : '\n', len);
+                        i += len;
+                } else if (r < 90) {
+                        i += put_code(s + i, any_code());
+                } else if (r < 97) {
+                        b = bad[rng() % (sizeof bad / sizeof bad[0])];
+                        len = strlen(b);
+                        memcpy(s + i, b, len);
+                        i += len;
+                } else {
+                        s[i++] = rng();
+                }
+                if (i > max - 8)
+                        i = max - 8;
+        }
+        return i;
+}
+
+
+static void show_input(const unsigned char *s, size_t n)
+{
+        size_t i;
+
+        fprintf(stderr, "  input (%zu bytes):", n);
+        for (i = 0; i < n; ++i)
+                fprintf(stderr, " %02x", s[i]);
+        fprintf(stderr, "\n");
+}
+
+
+/*
+ * Check each fast validator against the reference one: the valid prefix
+ * it finds must be what the portable one finds, and validating the input
+ * in random blocks must fail exactly when and where ref_scan() does.
+ */
+static int fuzz(unsigned long iterations)
+{
+        enum { MAX = 1024 };
+        unsigned char s[MAX];
+        struct ref_state st;
+        struct utf8_pos want, got;
+        size_t n, k, expect, off, end, left;
+        unsigned long it;
+        int ok, ok2, i;
+
+        for (it = 0; it < iterations; ++it) {
+                n = gen_fuzz(s, it % 16 == 0 ? MAX : 80);
+
+                st.nbytes = 0;
+                want.line = want.col = 1;
+                want.byteoff = 0;
+                ok = ref_scan(&st, &want, s, n, 1);
+                expect = scan_scalar(s, n);
+
+                for (i = 0; i < NKERNELS; ++i) {
+                        if (!kernels[i].usable)
+                                continue;
+                        k = kernels[i].scan(s, n);
+                        if (k != expect || (k == n) != ok) {
+                                fprintf(stderr, "%s: valid prefix %zu, "
+                                        "expected %zu, reference says "
+                                        "%s\n", kernels[i].name, k,
+                                        expect, ok ? "valid" : "invalid");
+                                show_input(s, n);
+                                return 0;
+                        }
+
+                        scan_utf8 = kernels[i].scan;
+                        got.line = got.col = 1;
+                        got.byteoff = 0;
+                        off = left = 0;
+                        do {
+                                end = off + rng_range(1, 64);
+                                if (end > n)
+                                        end = n;
+                                ok2 = validate_block(s + off - left,
+                                                     end - off + left,
+                                                     end == n, &got, &left);
+                                off = end;
+                        } while (ok2 && end < n);
+                        if (ok2 != ok || (!ok &&
+                            (got.line != want.line || got.col != want.col ||
+                             got.byteoff != want.byteoff))) {
+                                fprintf(stderr, "%s: in blocks, %s at "
+                                        "%lu/%lu/%lu, reference says %s "
+                                        "at %lu/%lu/%lu\n",
+                                        kernels[i].name,
+                                        ok2 ? "valid" : "invalid",
+                                        got.line, got.col, got.byteoff,
+                                        ok ? "valid" : "invalid",
+                                        want.line, want.col, want.byteoff);
+                                show_input(s, n);
+                                return 0;
+                        }
+                }
+        }
+        return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+        unsigned long size = 64, iterations = 200000;
+        int reps = 5, opt, k;
+
+        while ((opt = getopt(argc, argv, "s:r:n:S:")) != -1) {
+                switch (opt) {
+                case 's':
+                        size = strtoul(optarg, NULL, 10);
+                        break;
+                case 'r':
+                        reps = atoi(optarg);
+                        break;
+                case 'n':
+                        iterations = strtoul(optarg, NULL, 10);
+                        break;
+                case 'S':
+                        rng_state = strtoull(optarg, NULL, 10) | 1;
+                        break;
+                default:
+                        fprintf(stderr, "Usage: %s [-s megabytes] "
+                                "[-r repetitions] [-n fuzz-iterations] "
+                                "[-S seed]\n", argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (size < 1 || reps < 1) {
+                fprintf(stderr, "isutf8-bench: bad size or repetitions\n");
+                exit(EXIT_FAILURE);
+        }
+
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        kernels[1].usable = __builtin_cpu_supports("sse4.1");
+        kernels[2].usable = __builtin_cpu_supports("avx2");
+#endif
+
+        bench(size * 1024 * 1024, reps);
+
+        printf("fuzzing %lu inputs against the reference validator\n",
+               iterations);
+        fflush(stdout);
+        if (!fuzz(iterations)) {
+                printf("FAILED\n");
+                exit(EXIT_FAILURE);
+        }
+        for (k = 0; k < NKERNELS; ++k)
+                if (kernels[k].usable)
+                        printf("  %s: ok\n", kernels[k].name);
+        exit(0);
+}
@@ -18,12 +18,25 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 
 #define VERSION "1.1"
@@ -140,80 +153,1358 @@ static unsigned long decodeutf8(unsigned char *buf, int nbytes)
 
 
 /*
- * Determine if the contents of an open file form a valid UTF8 byte stream.
- * Do this by collecting bytes for a character into a buffer and then
- * decode the bytes and re-encode them and compare that they are identical
- * to the original bytes. If any step fails, return 0 for error. If EOF
- * is reached, return 1 for OK.
+ * Position in the input, as given in error messages: the line, the
+ * number of the multibyte character in it (plus one), and the byte
+ * offset within the line.
+ */
+struct utf8_pos {
+        unsigned long line, col, byteoff;
+};
+
+
+/*
+ * State of the reference validator between calls: the bytes collected
+ * for a character that is not yet known to be complete.
  */
-static int is_utf8_byte_stream(FILE *file, char *filename, int quiet) {
-        enum { MAX_UTF8_BYTES = 6 };
+enum { MAX_UTF8_BYTES = 6 };
+struct ref_state {
         unsigned char buf[MAX_UTF8_BYTES];
+        int nbytes;
+};
+
+
+/*
+ * The reference validator. Collect the bytes for a character into a
+ * buffer and, when the next character starts, decode the bytes and
+ * re-encode them and compare that they are identical to the original
+ * bytes. Feed it n bytes from 'p', followed by EOF if 'eof' is set.
+ * Return 0 for error, with 'pos' at the point the error was noticed,
+ * or 1 if no error was found.
+ *
+ * This is slow, but it defines what is valid; the fast validators below
+ * only look for the first place where it would complain.
+ */
+static int ref_scan(struct ref_state *st, struct utf8_pos *pos,
+                    const unsigned char *p, size_t n, int eof)
+{
         unsigned char buf2[MAX_UTF8_BYTES];
-        int nbytes, nbytes2;
+        int nbytes2;
         int c;
         unsigned long code;
-        unsigned long line, col, byteoff;
+        size_t i;
+
+        for (i = 0; i <= n; ++i) {
+                if (i == n) {
+                        if (!eof)
+                                break;
+                        c = EOF;
+                } else
+                        c = p[i];
 
-        nbytes = 0;
-        line = 1;
-        col = 1;
-        byteoff = 0;
-                
-        for (;;) {
-                c = getc(file);
-    
                 if (c == EOF || c < 0x80 || (c & 0xC0) != 0x80) {
                         /* New char starts, deal with previous one. */
-                        if (nbytes > 0) {
-                                code = decodeutf8(buf, nbytes);
+                        if (st->nbytes > 0) {
+                                code = decodeutf8(st->buf, st->nbytes);
                                 if (code == INVALID_CHAR)
-                                        goto error;
-                                nbytes2 = encodeutf8(code, buf2, 
+                                        return 0;
+                                nbytes2 = encodeutf8(code, buf2,
                                                      MAX_UTF8_BYTES);
-                                if (nbytes != nbytes2 || 
-                                    memcmp(buf, buf2, nbytes) != 0)
-                                        goto error;
-                                ++col;
+                                if (st->nbytes != nbytes2 ||
+                                    memcmp(st->buf, buf2, st->nbytes) != 0)
+                                        return 0;
+                                ++pos->col;
                         }
-                        nbytes = 0;
+                        st->nbytes = 0;
                         /* If it's UTF8, start collecting again. */
                         if (c != EOF && c >= 0x80)
-                                buf[nbytes++] = c;
+                                st->buf[st->nbytes++] = c;
                 } else {
                         /* This is a continuation byte, append to buffer. */
-                        if (nbytes == MAX_UTF8_BYTES)
-                                goto error;
-                        buf[nbytes++] = c;
+                        if (st->nbytes == MAX_UTF8_BYTES)
+                                return 0;
+                        st->buf[st->nbytes++] = c;
                 }
-    
+
                 if (c == EOF)
                         break;
                 else if (c == '\n') {
-                        ++line;
-                        byteoff = 0;
-                        col = 1;
+                        ++pos->line;
+                        pos->byteoff = 0;
+                        pos->col = 1;
                 } else
-                        ++byteoff;
+                        ++pos->byteoff;
         }
-        
-        if (nbytes != 0)
-                goto error;
 
-	return 1;
-	
-error:
-	if (!quiet) {
-		printf("%s: line %lu, char %lu, byte offset %lu: "
-		       "invalid UTF-8 code\n", filename, line, col, byteoff);
-	}
-	return 0;
+        if (eof && st->nbytes != 0)
+                return 0;
+        return 1;
+}
+
+
+static int is_cont(unsigned char c)
+{
+        return (c & 0xC0) == 0x80;
+}
+
+
+/*
+ * Length of the sequence introduced by each lead byte, or 0 if the byte
+ * cannot start a valid sequence: continuation bytes, the overlong 0xC0
+ * and 0xC1, and 0xFE and 0xFF.
+ */
+static const unsigned char seq_len[256] = {
+        /* 0x00 - 0x7F */
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0x80 - 0xBF */
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        /* 0xC0 - 0xDF */
+        0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        /* 0xE0 - 0xEF */
+        3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+        /* 0xF0 - 0xF7, 0xF8 - 0xFB, 0xFC - 0xFD, 0xFE - 0xFF */
+        4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 0, 0,
+};
+
+
+/*
+ * Portable validator. Return the length of the longest prefix of the 'n'
+ * bytes at 's' that consists of complete characters the reference
+ * validator accepts. The bytes are assumed to be followed by something
+ * that is not a continuation byte (or EOF). So the return value is 'n'
+ * if all is well, and otherwise the offset of the first bad sequence.
+ *
+ * Same rules as decodeutf8() and encodeutf8(): up to six bytes, no
+ * overlong forms, no UTF-16 surrogates, no 0xFFFE or 0xFFFF.
+ */
+static size_t scan_scalar(const unsigned char *s, size_t n)
+{
+        size_t i = 0, len, j;
+        uint64_t w;
+        unsigned char c, c1;
+
+        while (i < n) {
+                c = s[i];
+                if (c < 0x80) {
+                        /* ASCII, skip eight bytes at a time */
+                        ++i;
+                        while (i + 8 <= n) {
+                                memcpy(&w, s + i, 8);
+                                if (w & 0x8080808080808080ULL)
+                                        break;
+                                i += 8;
+                        }
+                        continue;
+                }
+
+                len = seq_len[c];
+                if (len == 0 || len > n - i)
+                        return i;
+                c1 = s[i + 1];
+                if (!is_cont(c1))
+                        return i;
+                switch (c) {
+                case 0xE0: if (c1 < 0xA0) return i; break; /* overlong */
+                case 0xED: if (c1 > 0x9F) return i; break; /* surrogate */
+                case 0xEF: /* 0xFFFE and 0xFFFF */
+                        if (c1 == 0xBF && (s[i + 2] | 1) == 0xBF)
+                                return i;
+                        break;
+                case 0xF0: if (c1 < 0x90) return i; break; /* overlong */
+                case 0xF8: if (c1 < 0x88) return i; break; /* overlong */
+                case 0xFC: if (c1 < 0x84) return i; break; /* overlong */
+                }
+                for (j = 2; j < len; ++j)
+                        if (!is_cont(s[i + j]))
+                                return i;
+                /* More continuation bytes than the lead byte says. */
+                if (i + len < n && is_cont(s[i + len]))
+                        return i;
+                i += len;
+        }
+        return n;
+}
+
+
+/*
+ * Start of the sequence containing the byte before 'i', or 'i' if that
+ * is ASCII or before 'start'. The bytes from 'start' are known to be
+ * well-formed up to 'i', so this is at most a few bytes back.
+ */
+static size_t seq_start(const unsigned char *s, size_t start, size_t i)
+{
+        size_t b = i;
+
+        while (b > start && is_cont(s[b - 1]))
+                --b;
+        if (b > start && s[b - 1] >= 0xC0)
+                --b;
+        return b;
+}
+
+
+/* First byte at or after 'i' that is not a continuation byte, or 'n'. */
+static size_t next_boundary(const unsigned char *s, size_t n, size_t i)
+{
+        while (i < n && is_cont(s[i]))
+                ++i;
+        return i;
+}
+
+
+#ifdef HAVE_X86_SIMD
+/*
+ * Vectorized validators, after Keiser and Lemire, "Validating UTF-8 In
+ * Less Than One Instruction Per Byte". Three table lookups on the nibbles
+ * of each byte and the one before it flag every error in two-byte windows,
+ * and a check on the bytes two and three back catches missing or surplus
+ * continuation bytes. Runs of ASCII are skipped a whole vector at a time.
+ *
+ * They check for standard UTF-8 (at most U+10FFFF, four bytes), plus the
+ * 0xFFFE/0xFFFF rule. The five and six byte forms and four byte forms
+ * above U+10FFFF that decodeutf8() also accepts are flagged as errors by
+ * the tables, so any vector with a flagged error is rechecked with
+ * scan_scalar(), which makes the final decision. Return value as for
+ * scan_scalar().
+ */
+
+/* Error bits in the lookup tables. */
+#define TOO_SHORT   (1 << 0)  /* 11______ 0_______ or 11______ 11______ */
+#define TOO_LONG    (1 << 1)  /* 0_______ 10______ */
+#define OVERLONG_3  (1 << 2)  /* 11100000 100_____ */
+#define TOO_LARGE   (1 << 3)  /* 11110100 1001____ and up */
+#define SURROGATE   (1 << 4)  /* 11101101 101_____ */
+#define OVERLONG_2  (1 << 5)  /* 1100000_ 10______ */
+#define TOO_LARGE_1000 (1 << 6) /* 11110101 1000____ and up */
+#define OVERLONG_4  (1 << 6)  /* 11110000 1000____ */
+#define TWO_CONTS   (1 << 7)  /* 10______ 10______ */
+#define CARRY       (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH_TABLE(set) set( \
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+        TOO_SHORT | OVERLONG_2, \
+        TOO_SHORT, \
+        TOO_SHORT | OVERLONG_3 | SURROGATE, \
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4)
+
+#define BYTE_1_LOW_TABLE(set) set( \
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+        CARRY | OVERLONG_2, \
+        CARRY, \
+        CARRY, \
+        CARRY | TOO_LARGE, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000)
+
+#define BYTE_2_HIGH_TABLE(set) set( \
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT)
+
+/* Bytes that leave a sequence unfinished at the end of a vector. */
+#define INCOMPLETE_16(set) set( \
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, \
+        0xF0 - 1, 0xE0 - 1, 0xC0 - 1)
+
+#define SET16(...) _mm_setr_epi8(__VA_ARGS__)
+#define SET32(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+#define SET32_INCOMPLETE(...) _mm256_setr_epi8( \
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, \
+        __VA_ARGS__)
+
+__attribute__((target("sse4.1")))
+static size_t scan_sse41(const unsigned char *s, size_t n)
+{
+        const __m128i byte_1_high = BYTE_1_HIGH_TABLE(SET16);
+        const __m128i byte_1_low = BYTE_1_LOW_TABLE(SET16);
+        const __m128i byte_2_high = BYTE_2_HIGH_TABLE(SET16);
+        const __m128i max_complete = INCOMPLETE_16(SET16);
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i in, prev = zero, incomplete = zero, err;
+        __m128i prev1, prev2, prev3, sc, must23, nonchar;
+        size_t i = 0, start = 0, b, e, k;
+
+        while (i + 16 <= n) {
+                in = _mm_loadu_si128((const __m128i *)(s + i));
+                if (_mm_movemask_epi8(in) == 0) {
+                        /* ASCII: only a sequence left open by the
+                         * previous vector can be wrong. */
+                        err = incomplete;
+                        incomplete = zero;
+                } else {
+                        prev1 = _mm_alignr_epi8(in, prev, 15);
+                        prev2 = _mm_alignr_epi8(in, prev, 14);
+                        prev3 = _mm_alignr_epi8(in, prev, 13);
+                        sc = _mm_and_si128(_mm_and_si128(
+                                _mm_shuffle_epi8(byte_1_high, _mm_and_si128(
+                                        _mm_srli_epi16(prev1, 4), nibble)),
+                                _mm_shuffle_epi8(byte_1_low, _mm_and_si128(
+                                        prev1, nibble))),
+                                _mm_shuffle_epi8(byte_2_high, _mm_and_si128(
+                                        _mm_srli_epi16(in, 4), nibble)));
+                        must23 = _mm_and_si128(_mm_or_si128(
+                                _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80)),
+                                _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80))),
+                                _mm_set1_epi8((char)0x80));
+                        nonchar = _mm_and_si128(_mm_and_si128(
+                                _mm_cmpeq_epi8(prev2, _mm_set1_epi8((char)0xEF)),
+                                _mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xBF))),
+                                _mm_cmpeq_epi8(_mm_or_si128(in, _mm_set1_epi8(1)),
+                                               _mm_set1_epi8((char)0xBF)));
+                        err = _mm_or_si128(_mm_xor_si128(must23, sc), nonchar);
+                        incomplete = _mm_subs_epu8(in, max_complete);
+                }
+                if (!_mm_testz_si128(err, err)) {
+                        b = seq_start(s, start, i);
+                        e = next_boundary(s, n, i + 16);
+                        k = scan_scalar(s + b, e - b);
+                        if (k < e - b)
+                                return b + k;
+                        /* A valid form the tables do not cover; carry
+                         * on from the next character boundary. */
+                        i = start = e;
+                        prev = incomplete = zero;
+                        continue;
+                }
+                prev = in;
+                i += 16;
+        }
+        b = seq_start(s, start, i);
+        return b + scan_scalar(s + b, n - b);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const unsigned char *s, size_t n)
+{
+        const __m256i byte_1_high = BYTE_1_HIGH_TABLE(SET32);
+        const __m256i byte_1_low = BYTE_1_LOW_TABLE(SET32);
+        const __m256i byte_2_high = BYTE_2_HIGH_TABLE(SET32);
+        const __m256i max_complete = INCOMPLETE_16(SET32_INCOMPLETE);
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i in, prev = zero, incomplete = zero, err, shifted;
+        __m256i prev1, prev2, prev3, sc, must23, nonchar;
+        size_t i = 0, start = 0, b, e, k;
+
+        while (i + 32 <= n) {
+                in = _mm256_loadu_si256((const __m256i *)(s + i));
+                if (_mm256_movemask_epi8(in) == 0) {
+                        err = incomplete;
+                        incomplete = zero;
+                } else {
+                        shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+                        prev1 = _mm256_alignr_epi8(in, shifted, 15);
+                        prev2 = _mm256_alignr_epi8(in, shifted, 14);
+                        prev3 = _mm256_alignr_epi8(in, shifted, 13);
+                        sc = _mm256_and_si256(_mm256_and_si256(
+                                _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(
+                                        _mm256_srli_epi16(prev1, 4), nibble)),
+                                _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(
+                                        prev1, nibble))),
+                                _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(
+                                        _mm256_srli_epi16(in, 4), nibble)));
+                        must23 = _mm256_and_si256(_mm256_or_si256(
+                                _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+                                _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80))),
+                                _mm256_set1_epi8((char)0x80));
+                        nonchar = _mm256_and_si256(_mm256_and_si256(
+                                _mm256_cmpeq_epi8(prev2, _mm256_set1_epi8((char)0xEF)),
+                                _mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char)0xBF))),
+                                _mm256_cmpeq_epi8(_mm256_or_si256(in, _mm256_set1_epi8(1)),
+                                                  _mm256_set1_epi8((char)0xBF)));
+                        err = _mm256_or_si256(_mm256_xor_si256(must23, sc), nonchar);
+                        incomplete = _mm256_subs_epu8(in, max_complete);
+                }
+                if (!_mm256_testz_si256(err, err)) {
+                        b = seq_start(s, start, i);
+                        e = next_boundary(s, n, i + 32);
+                        k = scan_scalar(s + b, e - b);
+                        if (k < e - b)
+                                return b + k;
+                        i = start = e;
+                        prev = incomplete = zero;
+                        continue;
+                }
+                prev = in;
+                i += 32;
+        }
+        b = seq_start(s, start, i);
+        return b + scan_scalar(s + b, n - b);
+}
+#endif
+
+
+/*
+ * The fastest validator this CPU supports, chosen on first use.
+ */
+static size_t (*scan_utf8)(const unsigned char *, size_t);
+
+static void choose_scanner(void)
+{
+        scan_utf8 = scan_scalar;
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                scan_utf8 = scan_avx2;
+        else if (__builtin_cpu_supports("sse4.1"))
+                scan_utf8 = scan_sse41;
+#endif
+}
+
+
+/* Number of bytes 'c' in the 'n' bytes at 's'. */
+static unsigned long count_byte(const unsigned char *s, size_t n, unsigned char c)
+{
+        const uint64_t ones = 0x0101010101010101ULL;
+        const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+        unsigned long count = 0;
+        uint64_t w;
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+                memcpy(&w, s + i, 8);
+                w ^= ones * c;
+                /* high bit set in each byte of w that is zero */
+                w = ~(((w & low7) + low7) | w | low7);
+                count += __builtin_popcountll(w);
+        }
+        for (; i < n; ++i)
+                count += s[i] == c;
+        return count;
+}
+
+
+/* Number of multibyte character lead bytes in the 'n' bytes at 's'. */
+static unsigned long count_leads(const unsigned char *s, size_t n)
+{
+        unsigned long count = 0;
+        uint64_t w;
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+                memcpy(&w, s + i, 8);
+                count += __builtin_popcountll(w & (w << 1) &
+                                              0x8080808080808080ULL);
+        }
+        for (; i < n; ++i)
+                count += s[i] >= 0xC0;
+        return count;
+}
+
+
+/*
+ * Move 'pos' past the 'n' bytes at 's', which the validators have found
+ * to be valid, counting the way ref_scan() does.
+ */
+static void advance_pos(struct utf8_pos *pos, const unsigned char *s, size_t n)
+{
+        const unsigned char *nl = memrchr(s, '\n', n);
+
+        if (nl != NULL) {
+                pos->line += count_byte(s, nl - s + 1, '\n');
+                n -= nl + 1 - s;
+                s = nl + 1;
+                pos->col = 1;
+                pos->byteoff = 0;
+        }
+        pos->col += count_leads(s, n);
+        pos->byteoff += n;
+}
+
+
+/*
+ * How much of the 'n' bytes at 's' can be validated before more input is
+ * seen: all of it, except a sequence that may be continued by the next
+ * bytes. A run of more than six continuation bytes is invalid whatever
+ * follows, so it is not held back.
+ */
+static size_t complete_prefix(const unsigned char *s, size_t n)
+{
+        size_t j = n;
+
+        while (j > 0 && n - j <= MAX_UTF8_BYTES && is_cont(s[j - 1]))
+                --j;
+        if (j > 0 && is_cont(s[j - 1]))
+                return n;
+        if (j > 0 && s[j - 1] >= 0x80)
+                return j - 1;
+        return j;
+}
+
+
+/*
+ * Validate a block of input that starts on a character boundary and
+ * advance 'pos' past it. Unless 'eof' is set, a trailing incomplete
+ * sequence is left alone, and its length returned in '*left'. Return 0
+ * for error, with 'pos' where the reference validator would report it.
+ */
+static int validate_block(const unsigned char *s, size_t n, int eof,
+                          struct utf8_pos *pos, size_t *left)
+{
+        struct ref_state st;
+        size_t limit, k;
+
+        limit = eof ? n : complete_prefix(s, n);
+        k = scan_utf8(s, limit);
+        if (k == limit) {
+                /* At EOF nobody will look at the position again. */
+                if (!eof)
+                        advance_pos(pos, s, k);
+                *left = n - limit;
+                return 1;
+        }
+        advance_pos(pos, s, k);
+        /* Let the reference validator say exactly where it fails. */
+        st.nbytes = 0;
+        if (!ref_scan(&st, pos, s + k, n - k, eof))
+                return 0;
+        /* Not reached unless the validators disagree; trust ref_scan()
+         * and carry on with the bytes it has not finished with. */
+        *left = st.nbytes;
+        pos->byteoff -= st.nbytes;
+        return 1;
+}
+
+
+/*
+ * A large mapped file can be validated by several threads at once, since
+ * UTF-8 synchronizes itself: cut at any byte that is not a continuation
+ * byte, the pieces are valid exactly when the whole is. Where the first
+ * error is found, the position of everything before it is worked out by
+ * counting each piece in parallel too, and adding up the results.
+ */
+enum { CHUNK_MIN = 16 * 1024 * 1024 };
+
+static int chunk_threads = 1;
+
+struct chunk {
+        const unsigned char *s;
+        size_t n;
+        size_t valid;           /* length of the valid prefix */
+        struct utf8_pos delta;  /* how the chunk moves the position */
+        int count;              /* set to count rather than validate */
+};
+
+
+static void *chunk_worker(void *arg)
+{
+        struct chunk *c = arg;
+
+        if (c->count) {
+                c->delta.line = 0;
+                c->delta.col = 0;
+                c->delta.byteoff = 0;
+                advance_pos(&c->delta, c->s, c->n);
+        } else {
+                c->valid = scan_utf8(c->s, c->n);
+        }
+        return NULL;
+}
+
+
+/* Run the first n chunks, the first in this thread and each other in
+ * its own, if it can have one. */
+static void run_chunks(struct chunk *chunks, pthread_t *threads, int n)
+{
+        int i;
+
+        for (i = 1; i < n; ++i) {
+                if (pthread_create(&threads[i], NULL, chunk_worker,
+                                   &chunks[i]) != 0) {
+                        chunk_worker(&chunks[i]);
+                        threads[i] = pthread_self();
+                }
+        }
+        chunk_worker(&chunks[0]);
+        for (i = 1; i < n; ++i) {
+                if (!pthread_equal(threads[i], pthread_self()))
+                        pthread_join(threads[i], NULL);
+        }
+}
+
+
+static int validate_chunked(const unsigned char *s, size_t size, int n,
+                            struct utf8_pos *pos)
+{
+        struct chunk *chunks;
+        pthread_t *threads;
+        struct ref_state st;
+        size_t start, end, off;
+        int i, bad;
+
+        chunks = calloc(n, sizeof *chunks);
+        threads = calloc(n, sizeof *threads);
+        if (!chunks || !threads) {
+                free(chunks);
+                free(threads);
+                return validate_block(s, size, 1, pos, &off);
+        }
+
+        start = 0;
+        for (i = 0; i < n; ++i) {
+                end = i == n - 1 ? size : size / n * (i + 1);
+                if (end < start)
+                        end = start;
+                while (end < size && is_cont(s[end]))
+                        ++end;
+                chunks[i].s = s + start;
+                chunks[i].n = end - start;
+                start = end;
+        }
+        run_chunks(chunks, threads, n);
+
+        for (bad = 0; bad < n; ++bad)
+                if (chunks[bad].valid < chunks[bad].n)
+                        break;
+        if (bad == n) {
+                free(chunks);
+                free(threads);
+                return 1;
+        }
+
+        chunks[bad].n = chunks[bad].valid;
+        for (i = 0; i <= bad; ++i)
+                chunks[i].count = 1;
+        run_chunks(chunks, threads, bad + 1);
+        for (i = 0; i <= bad; ++i) {
+                if (chunks[i].delta.line > 0) {
+                        pos->line += chunks[i].delta.line;
+                        pos->col = chunks[i].delta.col;
+                        pos->byteoff = chunks[i].delta.byteoff;
+                } else {
+                        pos->col += chunks[i].delta.col;
+                        pos->byteoff += chunks[i].delta.byteoff;
+                }
+        }
+        off = chunks[bad].s - s + chunks[bad].valid;
+        free(chunks);
+        free(threads);
+
+        /* Let the reference validator say exactly where it fails. */
+        st.nbytes = 0;
+        return ref_scan(&st, pos, s + off, size - off, 1);
+}
+
+
+/*
+ * Map the rest of a regular file, from its current offset (stdin may
+ * have been partly read already), for reading it through once. Return
+ * NULL if there is nothing left or it cannot be mapped.
+ */
+static void *map_file(int fd, size_t *size)
+{
+        struct stat st;
+        off_t off, skip;
+        char *map;
+
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+            (off = lseek(fd, 0, SEEK_CUR)) == -1 || off >= st.st_size ||
+            (uintmax_t)st.st_size > SIZE_MAX)
+                return NULL;
+        /* mmap() offsets must be page aligned */
+        skip = off % sysconf(_SC_PAGESIZE);
+        map = mmap(NULL, st.st_size - off + skip, PROT_READ, MAP_PRIVATE,
+                   fd, off - skip);
+        if (map == MAP_FAILED)
+                return NULL;
+        (void) madvise(map, st.st_size - off + skip, MADV_SEQUENTIAL);
+        *size = st.st_size - off;
+        return map + skip;
+}
+
+/* Undo map_file(). */
+static void unmap_file(void *data, size_t size)
+{
+        size_t skip = (uintptr_t)data % sysconf(_SC_PAGESIZE);
+
+        (void) munmap((char *)data - skip, size + skip);
+}
+
+
+/*
+ * Validate a whole regular file, mapped into memory, in chunks on
+ * several threads if it is large enough and that is allowed. Return -1
+ * if it cannot be mapped, otherwise as validate_block().
+ */
+static int validate_mapped(int fd, struct utf8_pos *pos)
+{
+        size_t size, left;
+        void *map;
+        int ok, n;
+
+        map = map_file(fd, &size);
+        if (map == NULL)
+                return -1;
+        n = chunk_threads;
+        if (size / CHUNK_MIN < (size_t)n)
+                n = size / CHUNK_MIN;
+        if (n > 1)
+                ok = validate_chunked(map, size, n, pos);
+        else
+                ok = validate_block(map, size, 1, pos, &left);
+        unmap_file(map, size);
+        return ok;
+}
+
+
+/*
+ * Read all of 'fd' in large page-aligned blocks and hand them to 'fn',
+ * keeping the '*left' bytes it did not finish with just in front of the
+ * next block. The last call has 'eof' set. Return 1 when all is read, 0
+ * if 'fn' returns 0 to stop early, or -1 for a read error, with errno set.
+ */
+static int read_blocks(int fd,
+                       int (*fn)(const unsigned char *s, size_t n, int eof,
+                                 size_t *left, void *arg),
+                       void *arg)
+{
+        enum { BLOCK = 1024 * 1024, ALIGN = 4096 };
+        static __thread unsigned char *base;
+        unsigned char *buf;
+        size_t left;
+        ssize_t r;
+
+        if (!base && posix_memalign((void **)&base, ALIGN, ALIGN + BLOCK)) {
+                fprintf(stderr, "isutf8: out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        buf = base + ALIGN;
+        left = 0;
+        do {
+                r = read(fd, buf, BLOCK);
+                if (r == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                if (!fn(buf - left, left + r, r == 0, &left, arg))
+                        return 0;
+                memmove(buf - left, buf + r - left, left);
+        } while (r != 0);
+        return 1;
+}
+
+
+static int check_block(const unsigned char *s, size_t n, int eof,
+                       size_t *left, void *pos)
+{
+        return validate_block(s, n, eof, pos, left);
+}
+
+
+/*
+ * Validate everything read from 'fd'. Regular files are mapped and
+ * validated in one go, anything else is read in blocks. Return 1 if
+ * valid, 0 if not, with 'pos' set to the error, or -1 for a read error,
+ * with errno set.
+ */
+static int check_fd(int fd, struct utf8_pos *pos) {
+        int ok;
+
+        pos->line = 1;
+        pos->col = 1;
+        pos->byteoff = 0;
+
+        ok = validate_mapped(fd, pos);
+        if (ok != -1)
+                return ok;
+        return read_blocks(fd, check_block, pos);
+}
+
+
+/*
+ * Listing every invalid sequence. A sequence is invalid from the byte
+ * where the validators stop, through any continuation bytes after it,
+ * and scanning resumes after that. A sequence that may go on in the next
+ * block is kept pending until it ends.
+ *
+ * Filtering works the same way, but copies the valid input to 'out' and
+ * writes the replacement (if any) in place of each invalid sequence.
+ *
+ * Statistics, if wanted, are gathered from the same valid spans and
+ * invalid sequences, whatever else is being done with them.
+ */
+enum { LIST_NONE, LIST_FIRST, LIST_ALL, LIST_FILTER, LIST_STATS };
+enum { FORMAT_TSV, FORMAT_JSON };
+enum { MAX_SHOWN = 16 };        /* bytes of a sequence printed */
+
+static int listing;
+static int format = FORMAT_TSV;
+static unsigned long max_errors;
+static const char *replacement = "\xef\xbf\xbd";   /* U+FFFD */
+static int want_stats;
+
+struct bad_seq {
+        uintmax_t off;          /* from the start of the file, from 0 */
+        unsigned long line;
+        uintmax_t col;          /* in bytes, from 1 */
+        uintmax_t len;
+        unsigned char bytes[MAX_SHOWN];
+};
+
+struct stats {
+        uintmax_t chars;
+        uintmax_t lines;
+        uintmax_t ascii;
+        uintmax_t bylen[MAX_UTF8_BYTES + 1];    /* multibyte, by length */
+        uintmax_t linelen;      /* characters so far in this line */
+        uintmax_t maxline;
+        uintmax_t overlong;
+        uintmax_t surrogate;
+        uintmax_t nonchar;      /* 0xFFFE and 0xFFFF */
+        uintmax_t other;
+};
+
+struct lister {
+        FILE *out;
+        const char *filename;
+        unsigned long count;
+        uintmax_t off;          /* of the current block */
+        unsigned long line;
+        uintmax_t linestart;    /* offset of the current line */
+        int pending;
+        struct bad_seq seq;
+        struct stats st;
+};
+
+
+static void json_string(FILE *out, const char *s)
+{
+        putc('"', out);
+        for (; *s; ++s) {
+                if (*s == '"' || *s == '\\')
+                        fprintf(out, "\\%c", *s);
+                else if ((unsigned char) *s < 0x20)
+                        fprintf(out, "\\u%04x", *s);
+                else
+                        putc(*s, out);
+        }
+        putc('"', out);
+}
+
+
+/*
+ * Add up the characters in valid input, by length. Bytes with the top
+ * 1, 2, ... 5 bits set are those starting characters of at least 1, 2,
+ * ... 5 bytes; continuation bytes are included in the first count.
+ */
+static void add_chars(struct stats *st, const unsigned char *s, size_t n)
+{
+        const uint64_t high = 0x8080808080808080ULL;
+        uintmax_t ge[6] = { 0 };
+        uint64_t w, m;
+        size_t i = 0;
+        int b;
+
+        for (; i + 8 <= n; i += 8) {
+                memcpy(&w, s + i, 8);
+                m = w;
+                for (b = 1; b <= 5 && (m & high); ++b) {
+                        ge[b] += __builtin_popcountll(m & high);
+                        m &= w << b;
+                }
+        }
+        for (; i < n; ++i)
+                for (b = 1; b <= 5 && s[i] >= 0x100 - (0x100 >> b); ++b)
+                        ge[b]++;
+
+        st->ascii += n - ge[1];
+        st->chars += n - ge[1] + ge[2];
+        st->linelen += n - ge[1] + ge[2];
+        st->bylen[2] += ge[2] - ge[3];
+        st->bylen[3] += ge[3] - ge[4];
+        st->bylen[4] += ge[4] - ge[5];
+        st->bylen[5] += ge[5];  /* 5 and 6 byte forms, together */
+}
+
+
+static void add_valid(struct stats *st, const unsigned char *s, size_t n)
+{
+        const unsigned char *nl;
+
+        while ((nl = memchr(s, '\n', n)) != NULL) {
+                add_chars(st, s, nl - s);
+                if (st->linelen > st->maxline)
+                        st->maxline = st->linelen;
+                st->linelen = 0;
+                st->chars++;
+                st->ascii++;
+                st->lines++;
+                n -= nl + 1 - s;
+                s = nl + 1;
+        }
+        add_chars(st, s, n);
+}
+
+
+/* Sort an invalid sequence by what is wrong with it. */
+static void add_invalid(struct stats *st, const struct bad_seq *q)
+{
+        static const unsigned long min[] = {
+                0, 0, 0x80, 0x800, 0x10000, 0x200000, 0x4000000
+        };
+        unsigned long u;
+        size_t len, i;
+
+        len = q->bytes[0] >= 0xC0 ? seq_len[q->bytes[0]] : 0;
+        if (q->bytes[0] == 0xC0 || q->bytes[0] == 0xC1)
+                len = 2;
+        if (len < 2 || q->len != len) {
+                st->other++;
+                return;
+        }
+        u = q->bytes[0] & (0x7F >> len);
+        for (i = 1; i < len; ++i)
+                u = (u << 6) | (q->bytes[i] & 0x3F);
+        if (u < min[len])
+                st->overlong++;
+        else if (u >= 0xD800 && u <= 0xDFFF)
+                st->surrogate++;
+        else if (u == 0xFFFE || u == 0xFFFF)
+                st->nonchar++;
+        else
+                st->other++;
+}
+
+
+static double percent(uintmax_t part, uintmax_t whole)
+{
+        return whole ? 100.0 * part / whole : 0.0;
+}
+
+
+static void print_stats(FILE *out, struct lister *l)
+{
+        struct stats *st = &l->st;
+        uintmax_t multi, invalid;
+
+        if (st->linelen > st->maxline)
+                st->maxline = st->linelen;
+        multi = st->chars - st->ascii;
+        invalid = st->overlong + st->surrogate + st->nonchar + st->other;
+
+        if (format == FORMAT_JSON) {
+                fputs("{\"file\":", out);
+                json_string(out, l->filename);
+                fprintf(out, ",\"bytes\":%ju,\"chars\":%ju,"
+                        "\"lines\":%ju,\"ascii\":%ju,\"multibyte\":%ju,"
+                        "\"2byte\":%ju,\"3byte\":%ju,\"4byte\":%ju,"
+                        "\"5or6byte\":%ju,\"max_line\":%ju,"
+                        "\"invalid\":%ju,\"overlong\":%ju,"
+                        "\"surrogate\":%ju,\"noncharacter\":%ju,"
+                        "\"other\":%ju}\n",
+                        l->off, st->chars, st->lines, st->ascii, multi,
+                        st->bylen[2], st->bylen[3], st->bylen[4],
+                        st->bylen[5], st->maxline, invalid, st->overlong,
+                        st->surrogate, st->nonchar, st->other);
+                return;
+        }
+        fprintf(out, "%s:\n", l->filename);
+        fprintf(out, "  bytes          %ju\n", l->off);
+        fprintf(out, "  characters     %ju\n", st->chars);
+        fprintf(out, "  lines          %ju\n", st->lines);
+        fprintf(out, "  longest line   %ju characters\n", st->maxline);
+        fprintf(out, "  ASCII          %ju (%.1f%%)\n", st->ascii,
+                percent(st->ascii, st->chars));
+        fprintf(out, "  multibyte      %ju (%.1f%%)\n", multi,
+                percent(multi, st->chars));
+        fprintf(out, "    2 bytes      %ju\n", st->bylen[2]);
+        fprintf(out, "    3 bytes      %ju\n", st->bylen[3]);
+        fprintf(out, "    4 bytes      %ju\n", st->bylen[4]);
+        fprintf(out, "    5-6 bytes    %ju\n", st->bylen[5]);
+        fprintf(out, "  invalid        %ju\n", invalid);
+        fprintf(out, "    overlong     %ju\n", st->overlong);
+        fprintf(out, "    surrogate    %ju\n", st->surrogate);
+        fprintf(out, "    noncharacter %ju\n", st->nonchar);
+        fprintf(out, "    other        %ju\n", st->other);
+}
+
+
+static void print_seq(struct lister *l)
+{
+        struct bad_seq *q = &l->seq;
+        size_t i, shown;
+
+        if (want_stats)
+                add_invalid(&l->st, q);
+        if (listing == LIST_FILTER)
+                fputs(replacement, l->out);
+        if (listing != LIST_FIRST && listing != LIST_ALL)
+                return;
+        shown = q->len < MAX_SHOWN ? q->len : MAX_SHOWN;
+        if (format == FORMAT_JSON) {
+                fputs("{\"file\":", l->out);
+                json_string(l->out, l->filename);
+                fprintf(l->out, ",\"offset\":%ju,\"line\":%lu,"
+                        "\"column\":%ju,\"length\":%ju,\"bytes\":\"",
+                        q->off, q->line, q->col, q->len);
+        } else {
+                fprintf(l->out, "%s\t%ju\t%lu\t%ju\t%ju\t", l->filename,
+                        q->off, q->line, q->col, q->len);
+        }
+        for (i = 0; i < shown; ++i)
+                fprintf(l->out, "%02x", q->bytes[i]);
+        if (shown < q->len)
+                fputs("...", l->out);
+        fputs(format == FORMAT_JSON ? "\"}\n" : "\n", l->out);
 }
 
 
+static void add_to_seq(struct bad_seq *q, unsigned char c)
+{
+        if (q->len < MAX_SHOWN)
+                q->bytes[q->len] = c;
+        q->len++;
+}
+
+
+/* Count the lines in valid input, or copy it out when filtering. */
+static void pass_valid(struct lister *l, const unsigned char *s, size_t n)
+{
+        const unsigned char *nl;
+
+        if (want_stats)
+                add_valid(&l->st, s, n);
+        if (listing == LIST_FILTER) {
+                fwrite(s, 1, n, l->out);
+                return;
+        }
+        nl = memrchr(s, '\n', n);
+        if (nl != NULL) {
+                l->line += count_byte(s, nl - s + 1, '\n');
+                l->linestart = l->off + (nl + 1 - s);
+        }
+}
+
+
+/*
+ * Report the invalid sequences in a block, as for validate_block().
+ * Return 0 once max_errors have been reported.
+ */
+static int list_block(const unsigned char *s, size_t n, int eof,
+                      size_t *left, void *arg)
+{
+        struct lister *l = arg;
+        size_t i, k, len, limit;
+
+        i = 0;
+        *left = 0;
+        if (l->pending) {
+                while (i < n && is_cont(s[i]))
+                        add_to_seq(&l->seq, s[i++]);
+                if (i == n && !eof) {
+                        l->off += n;
+                        return 1;
+                }
+                l->pending = 0;
+                print_seq(l);
+                if (++l->count == max_errors)
+                        return 0;
+        }
+
+        limit = eof ? n : i + complete_prefix(s + i, n - i);
+        for (;;) {
+                k = scan_utf8(s + i, limit - i);
+                l->off += i;
+                pass_valid(l, s + i, k);
+                l->off -= i;
+                i += k;
+                if (i == limit)
+                        break;
+                /* A good character with too many continuation bytes
+                 * after it: only the extra ones are bad. */
+                len = seq_len[s[i]];
+                if (len > 1 && i + len < n && is_cont(s[i + len]) &&
+                    scan_scalar(s + i, len) == len) {
+                        pass_valid(l, s + i, len);
+                        i += len;
+                }
+
+                l->seq.off = l->off + i;
+                l->seq.line = l->line;
+                l->seq.col = l->off + i - l->linestart + 1;
+                l->seq.len = 0;
+                add_to_seq(&l->seq, s[i++]);
+                while (i < n && is_cont(s[i]))
+                        add_to_seq(&l->seq, s[i++]);
+                if (i == n && !eof) {
+                        l->pending = 1;
+                        l->off += n;
+                        return 1;
+                }
+                print_seq(l);
+                if (++l->count == max_errors)
+                        return 0;
+                if (i > limit)
+                        limit = i;
+        }
+        *left = n - limit;
+        l->off += limit;
+        return 1;
+}
+
+
+/*
+ * List the invalid sequences read from 'fd' on 'out', or filter it to
+ * 'out', and set '*count' to how many there are. Return 1 when all is
+ * read, 0 if max_errors stopped the listing, or -1 for a read error,
+ * with errno set.
+ */
+static int list_fd(int fd, const char *filename, FILE *out,
+                   unsigned long *count)
+{
+        struct lister l;
+        size_t size, left;
+        void *map;
+        int r;
+
+        memset(&l, 0, sizeof l);
+        l.out = out;
+        l.filename = filename;
+        l.line = 1;
+
+        map = map_file(fd, &size);
+        if (map != NULL) {
+                r = list_block(map, size, 1, &left, &l);
+                unmap_file(map, size);
+        } else {
+                r = read_blocks(fd, list_block, &l);
+        }
+        if (want_stats && r != -1)
+                print_stats(listing == LIST_FILTER ? stderr : out, &l);
+        *count = l.count;
+        return r;
+}
+
+
+/*
+ * Outcome of checking one file, kept until it is its turn to be printed.
+ */
+struct result {
+        int ok;                 /* as check_fd(), or -1 if it couldn't open */
+        int err;                /* errno, if ok is -1 */
+        struct utf8_pos pos;    /* error position, if ok is 0 */
+        char *out;              /* listing, if it has to wait */
+        size_t outlen;
+        unsigned long errors;   /* invalid sequences listed or filtered */
+        int capped;             /* listing stopped at max_errors */
+        int done;
+};
+
+
+static void list_result(struct result *res, int r)
+{
+        res->ok = r == -1 ? -1 : res->errors == 0;
+        res->capped = r == 0;
+}
+
+
+/*
+ * Check a file. When listing, the list goes to 'out', or if that is NULL,
+ * is kept in the result.
+ */
+static void check_file(const char *filename, struct result *res, FILE *out)
+{
+        FILE *f;
+        int fd;
+
+        res->ok = -1;
+        res->out = NULL;
+        res->capped = 0;
+        fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+                res->err = errno;
+                return;
+        }
+        if (!listing) {
+                res->ok = check_fd(fd, &res->pos);
+        } else if (out) {
+                list_result(res, list_fd(fd, filename, out, &res->errors));
+        } else {
+                f = open_memstream(&res->out, &res->outlen);
+                if (f == NULL) {
+                        fprintf(stderr, "isutf8: out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+                list_result(res, list_fd(fd, filename, f, &res->errors));
+                if (fclose(f) != 0) {
+                        fprintf(stderr, "isutf8: out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        res->err = errno;
+        (void) close(fd);
+}
+
+
+/* Print what is wrong with a file, if anything. Return 1 if it's OK. */
+static int report(const char *filename, struct result *res, int quiet)
+{
+        if (res->out) {
+                fwrite(res->out, 1, res->outlen, stdout);
+                free(res->out);
+                res->out = NULL;
+        }
+        if (res->ok == -1) {
+                fprintf(stderr, "isutf8: %s: error %d: %s\n",
+                        filename, res->err, strerror(res->err));
+                return 0;
+        }
+        if (res->capped && listing == LIST_ALL) {
+                fprintf(stderr, "isutf8: %s: stopped after %lu invalid "
+                        "sequences\n", filename, max_errors);
+        } else if (res->ok == 0 && !quiet && listing == LIST_FILTER) {
+                fprintf(stderr, "isutf8: %s: %s %lu invalid sequences\n",
+                        filename, *replacement ? "replaced" : "removed",
+                        res->errors);
+        } else if (res->ok == 0 && !quiet && !listing) {
+                printf("%s: line %lu, char %lu, byte offset %lu: "
+                       "invalid UTF-8 code\n", filename,
+                       res->pos.line, res->pos.col, res->pos.byteoff);
+        }
+        return res->ok;
+}
+
+
+/*
+ * Determine if the contents of an open file form a valid UTF8 byte stream,
+ * using the fastest validator available. If an error is found, say where
+ * (unless quiet) and return 0. If EOF is reached, return 1 for OK.
+ */
+static int is_utf8_byte_stream(int fd, char *filename, int quiet) {
+        struct result res;
+
+        if (!scan_utf8)
+                choose_scanner();
+        res.out = NULL;
+        res.capped = 0;
+        if (listing)
+                list_result(&res, list_fd(fd, filename, stdout, &res.errors));
+        else
+                res.ok = check_fd(fd, &res.pos);
+        res.err = errno;
+        return report(filename, &res, quiet);
+}
+
+
+/*
+ * Checking files in parallel: worker threads take the next unchecked
+ * file from the list, while the main thread prints the results in the
+ * order the files were given, as each becomes available.
+ */
+struct work {
+        char **files;
+        struct result *results;
+        int nfiles;
+        int next;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+};
+
+
+static void *worker(void *arg)
+{
+        struct work *w = arg;
+        struct result res;
+        int i;
+
+        for (;;) {
+                pthread_mutex_lock(&w->lock);
+                i = w->next++;
+                pthread_mutex_unlock(&w->lock);
+                if (i >= w->nfiles)
+                        return NULL;
+
+                check_file(w->files[i], &res, NULL);
+
+                pthread_mutex_lock(&w->lock);
+                w->results[i] = res;
+                w->results[i].done = 1;
+                pthread_cond_broadcast(&w->done);
+                pthread_mutex_unlock(&w->lock);
+        }
+}
+
+
+static int check_files_parallel(char **files, int nfiles, int jobs, int quiet)
+{
+        struct work w;
+        pthread_t *threads;
+        int i, n, ok = 1;
+
+        w.files = files;
+        w.nfiles = nfiles;
+        w.next = 0;
+        w.results = calloc(nfiles, sizeof *w.results);
+        threads = calloc(jobs, sizeof *threads);
+        if (!w.results || !threads) {
+                fprintf(stderr, "isutf8: out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.done, NULL);
+
+        for (n = 0; n < jobs && n < nfiles; ++n) {
+                if (pthread_create(&threads[n], NULL, worker, &w) != 0)
+                        break;
+        }
+        if (n == 0) {
+                fprintf(stderr, "isutf8: cannot create threads\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < nfiles; ++i) {
+                pthread_mutex_lock(&w.lock);
+                while (!w.results[i].done)
+                        pthread_cond_wait(&w.done, &w.lock);
+                pthread_mutex_unlock(&w.lock);
+                if (!report(files[i], &w.results[i], quiet))
+                        ok = 0;
+        }
+
+        while (n-- > 0)
+                pthread_join(threads[n], NULL);
+        free(threads);
+        free(w.results);
+        return ok;
+}
+
+
+#ifndef ISUTF8_NO_MAIN
 static void usage(const char *program_name) {
-	printf("Usage: %s [-hq] [--help] [--quiet] [file ...]\n", 
+	printf("Usage: %s [-ahq] [-j jobs] [--all] [--help] [--quiet] "
+	       "[--jobs=jobs]\n"
+	       "       [--format=tsv|json] [--max-errors=n] [--stats] "
+	       "[file ...]\n",
 	       program_name);
+	printf("       %s -f [-q] [--replace[=string] | --strip] "
+	       "[file ...]\n", program_name);
 	printf("Check whether input files are valid UTF-8.\n");
 	printf("This is version %s.\n", VERSION);
 }
@@ -221,18 +1512,32 @@ static void usage(const char *program_name) {
 
 int main(int argc, char **argv) {
 	int i, ok;
-	FILE *file;
+	struct result res;
+	char *end;
 
 	int quiet;
+	int jobs;
+	int filter;
 	struct option options[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "quiet", no_argument, &quiet, 1 },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "all", no_argument, NULL, 'a' },
+		{ "format", required_argument, NULL, 'F' },
+		{ "max-errors", required_argument, NULL, 'M' },
+		{ "filter", no_argument, NULL, 'f' },
+		{ "replace", optional_argument, NULL, 'R' },
+		{ "strip", no_argument, NULL, 'S' },
+		{ "stats", no_argument, &want_stats, 1 },
+		{ 0, 0, 0, 0 }
 	};
 	int opt;
 	
 	quiet = 0;
+	jobs = 1;
+	filter = 0;
 	
-	while ((opt = getopt_long(argc, argv, "hq", options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "afhqj:", options, NULL)) != -1) {
 		switch (opt) {
 		case 0:
 			break;
@@ -246,6 +1551,55 @@ int main(int argc, char **argv) {
 			quiet = 1;
 			break;
 
+		case 'j':
+			jobs = strtol(optarg, &end, 10);
+			if (*end || jobs < 1) {
+				fprintf(stderr, "isutf8: invalid number of "
+				        "jobs `%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'a':
+			listing = LIST_ALL;
+			break;
+
+		case 'F':
+			if (strcmp(optarg, "tsv") == 0)
+				format = FORMAT_TSV;
+			else if (strcmp(optarg, "json") == 0)
+				format = FORMAT_JSON;
+			else {
+				fprintf(stderr, "isutf8: unknown format "
+				        "`%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (listing == LIST_NONE)
+				listing = LIST_FIRST;
+			break;
+
+		case 'f':
+			filter = 1;
+			break;
+
+		case 'R':
+			if (optarg)
+				replacement = optarg;
+			break;
+
+		case 'S':
+			replacement = "";
+			break;
+
+		case 'M':
+			max_errors = strtoul(optarg, &end, 10);
+			if (*end || *optarg == '-' || *optarg == '\0') {
+				fprintf(stderr, "isutf8: invalid number of "
+				        "errors `%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case '?':
 			exit(EXIT_FAILURE);
 
@@ -254,26 +1608,45 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (filter) {
+		listing = LIST_FILTER;
+		max_errors = 0;
+		jobs = 1;
+		/* Write valid input in blocks as large as it is read in. */
+		setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+	} else if (want_stats) {
+		if (quiet || listing == LIST_NONE || listing == LIST_FIRST)
+			listing = LIST_STATS;
+	} else if (quiet) {
+		listing = LIST_NONE;
+	} else if (listing == LIST_FIRST) {
+		max_errors = 1;
+	}
+
+	choose_scanner();
+	if (argc - optind <= 1)
+		chunk_threads = jobs;
+
 	if (optind == argc)
-		ok = is_utf8_byte_stream(stdin, "stdin", quiet);
+		ok = is_utf8_byte_stream(0, "stdin", quiet);
+	else if (jobs > 1 && argc - optind > 1)
+		ok = check_files_parallel(argv + optind, argc - optind,
+		                          jobs, quiet);
 	else {
 		ok = 1;
 		for (i = optind; i < argc; ++i) {
-			file = fopen(argv[i], "r");
-			if (file == NULL) {
-				fprintf(stderr, "isutf8: %s: error %d: %s\n", 
-				                argv[i], errno, 
-				                strerror(errno));
-				ok = 0;
-			} else {
-			        if (! is_utf8_byte_stream(file, argv[i], quiet))
-			            ok = 0;
-				(void) fclose(file);
-			}
+			check_file(argv[i], &res, stdout);
+			if (! report(argv[i], &res, quiet))
+			    ok = 0;
 		}
 	}
 	
+	if (fflush(stdout) != 0 || ferror(stdout)) {
+		fprintf(stderr, "isutf8: write error: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 	if (ok)
 		exit(0);
 	exit(EXIT_FAILURE);
 }
+#endif /* ISUTF8_NO_MAIN */
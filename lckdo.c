@@ -8,6 +8,8 @@
 #define _GNU_SOURCE
 #define _BSD_SOURCE
 #include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -17,7 +19,15 @@
 #include <sysexits.h>
 #include <sys/file.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <signal.h>
+#include <time.h>
+#include <poll.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+# include <sys/sysmacros.h>
+# include <dirent.h>
+#endif
 
 /* compile with -DUSE_FLOCK to use flock() instead of fcntl() */
 
@@ -49,25 +59,442 @@ error(int errnum, int exitcode, const char *fmt, ...) {
 static const char *lckfile;
 static int quiet;
 
-static void sigalarm(int sig) {
-	if (quiet)
-		_exit(EX_TEMPFAIL);
-	error(0, EX_TEMPFAIL,
-		"lock file `%s' is already locked (timeout waiting)", lckfile);
+/* Set when the lock belongs to the open file, not to this process, so
+ * that it lasts as long as any process has the file open, and is not
+ * dropped when some other descriptor for the file is closed. Then the
+ * program can be exec()ed directly, with the lock held through the
+ * descriptor it inherits. flock() locks always work that way; fcntl()
+ * locks do with open file description (OFD) locks, on Linux since 3.15. */
+static int ofd;
+
+/* With -N, the lock is on one byte of the file, the first of the bytes
+ * 0 to nslots-1 that is free; so up to nslots programs can run at once. */
+static int nslots;
+static int slot = -1;
+
+#ifndef USE_FLOCK
+/* With -k, the lock (or the slots) start at a byte chosen by the key,
+ * so that any number of independent locks can share one file.
+ * Otherwise the lock is on the whole file, or the slots start at 0. */
+static off_t lock_start;
+static off_t lock_len;
+
+/* 64-bit FNV-1a hash of the key, made into an offset that leaves room
+ * for the slots after it. */
+static off_t key_offset(const char *key) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 0x100000001b3ULL;
+	}
+	return sizeof(off_t) < 8 ? (off_t)(h >> 34) : (off_t)(h >> 2);
+}
+
+static int setlock(int fd, struct flock *fl, int wait) {
+	int c;
+#ifdef F_OFD_SETLK
+	c = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, fl);
+	if (c == 0)
+		ofd = 1;
+	if (c == 0 || errno != EINVAL)
+		return c;
+	/* kernel without OFD locks: use the traditional ones */
+#endif
+	c = fcntl(fd, wait ? F_SETLKW : F_SETLK, fl);
+	return c;
+}
+#endif
+
+static int busy(int err) {
+	return err == EWOULDBLOCK || err == EAGAIN || err == EACCES;
+}
+
+/* Take the lock, waiting for it if 'wait' is set (but not with -N,
+ * where that is up to the caller). */
+static int lock(int fd, int shared, int wait) {
+#ifdef USE_FLOCK
+	ofd = 1;
+	return flock(fd, (shared ? LOCK_SH : LOCK_EX) | (wait ? 0 : LOCK_NB));
+#else
+	struct flock fl;
+	int i;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = shared ? F_RDLCK : F_WRLCK;
+	fl.l_start = lock_start;
+	fl.l_len = lock_len;
+	if (!nslots)
+		return setlock(fd, &fl, wait);
+	for (i = 0; i < nslots; i++) {
+		fl.l_start = lock_start + i;
+		fl.l_len = 1;
+		fl.l_pid = 0;
+		if (setlock(fd, &fl, 0) == 0) {
+			slot = i;
+			return 0;
+		}
+		if (!busy(errno))
+			return -1;
+	}
+	errno = EAGAIN;
+	return -1;
+#endif
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A lock on the lock file, as listed in /proc/locks. */
+struct lockent {
+	int waiting;		/* blocked waiting for it, not holding it */
+	char kind[8];		/* POSIX, OFDLCK or FLOCK */
+	char type[8];		/* READ or WRITE */
+	pid_t pid;		/* -1 if not known, as for OFD locks */
+	off_t start, end;	/* end is -1 for to end of file */
+	dev_t dev;		/* the file locked */
+	ino_t ino;
+};
+
+/* Who is in the way, seen when the lock is first found taken. */
+struct contention {
+	int holders;		/* locks held on the range wanted */
+	pid_t holder;		/* the process holding the first of them */
+	int waiting;		/* others queued up waiting for it */
+};
+
+#ifdef __linux__
+/* Parse a line in /proc/locks format, if it is about the file dev/ino. */
+static int parse_lockent(const char *line, dev_t dev, ino_t ino,
+		struct lockent *le) {
+	const char *p = strchr(line, ':');
+	char arrow[4], end[32];
+	unsigned int maj, min;
+	unsigned long long inode;
+	long long start;
+	int pid, n;
+
+	if (!p)
+		return 0;
+	p++;
+	le->waiting = 0;
+	if (sscanf(p, " %3s%n", arrow, &n) == 1 && strcmp(arrow, "->") == 0) {
+		le->waiting = 1;
+		p += n;
+	}
+	if (sscanf(p, " %7s %*s %7s %d %x:%x:%llu %lld %31s", le->kind,
+			le->type, &pid, &maj, &min, &inode, &start, end) != 8)
+		return 0;
+	if (makedev(maj, min) != dev || inode != (unsigned long long)ino)
+		return 0;
+	le->pid = pid;
+	le->dev = dev;
+	le->ino = ino;
+	le->start = start;
+	le->end = strcmp(end, "EOF") == 0 ? -1 : strtoll(end, NULL, 10);
+	return 1;
+}
+
+/* OFD locks are not owned by any process, so /proc/locks gives no pid
+ * for them. Instead, look through the processes that have the lock file
+ * open for the locks on their descriptors. That means reading every
+ * process's open files, so it is done once, noting each lock found and
+ * the process that has it. */
+static struct lockent *owned;
+static size_t nowned;
+static int owners_found;
+
+static void find_owners(dev_t dev, ino_t ino) {
+	DIR *proc, *fds;
+	struct dirent *p, *f;
+	struct lockent le, *more;
+	struct stat st;
+	char path[300], line[256];
+	size_t room = 0;
+	pid_t pid;
+	FILE *fi;
+
+	if ((proc = opendir("/proc")) == NULL)
+		return;
+	while ((p = readdir(proc)) != NULL) {
+		pid = atoi(p->d_name);
+		if (pid <= 0 || pid == getpid())
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+		if ((fds = opendir(path)) == NULL)
+			continue;
+		while ((f = readdir(fds)) != NULL) {
+			if (f->d_name[0] == '.' ||
+			    fstatat(dirfd(fds), f->d_name, &st, 0) < 0 ||
+			    st.st_dev != dev || st.st_ino != ino)
+				continue;
+			snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s",
+				pid, f->d_name);
+			if ((fi = fopen(path, "r")) == NULL)
+				continue;
+			while (fgets(line, sizeof(line), fi)) {
+				if (strncmp(line, "lock:", 5) != 0 ||
+				    !parse_lockent(line + 5, dev, ino, &le))
+					continue;
+				if (nowned == room) {
+					room = room ? room * 2 : 64;
+					more = realloc(owned, room * sizeof(*owned));
+					if (!more)
+						break;
+					owned = more;
+				}
+				le.pid = pid;
+				owned[nowned++] = le;
+			}
+			fclose(fi);
+		}
+		closedir(fds);
+	}
+	closedir(proc);
+}
+
+static pid_t ofd_holder(const struct lockent *want) {
+	size_t i;
+
+	if (!owners_found) {
+		find_owners(want->dev, want->ino);
+		owners_found = 1;
+	}
+	for (i = 0; i < nowned; i++)
+		if (owned[i].start == want->start && owned[i].end == want->end &&
+		    strcmp(owned[i].type, want->type) == 0)
+			return owned[i].pid;
+	return -1;
+}
+#endif
+
+/* The process holding a lock, or -1 if it cannot be found. Finding the
+ * holder of an OFD lock means looking through every process's open
+ * files, so this is only done for locks that matter. */
+static pid_t lock_holder(const struct lockent *le) {
+	if (le->pid > 0 || le->waiting)
+		return le->pid > 0 ? le->pid : -1;
+#ifdef __linux__
+	return ofd_holder(le);
+#else
+	return -1;
+#endif
+}
+
+/* Call fn for each lock on the open lock file, of the kind lckdo uses.
+ * Returns -1 if the locks cannot be listed. */
+static int scan_locks(int fd,
+		void (*fn)(const struct lockent *, void *), void *arg) {
+#ifdef __linux__
+	struct lockent le;
+	struct stat st;
+	char line[256];
+	FILE *f;
+
+	if (fstat(fd, &st) < 0 || (f = fopen("/proc/locks", "re")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (!parse_lockent(line, st.st_dev, st.st_ino, &le))
+			continue;
+#ifdef USE_FLOCK
+		if (strcmp(le.kind, "FLOCK") != 0)
+#else
+		if (strcmp(le.kind, "FLOCK") == 0)
+#endif
+			continue;
+		fn(&le, arg);
+	}
+	fclose(f);
+	return 0;
+#else
+	(void)fd; (void)fn; (void)arg;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void count_lock(const struct lockent *le, void *arg) {
+	struct contention *ct = arg;
+#ifndef USE_FLOCK
+	off_t last = nslots ? lock_start + nslots - 1 :
+		lock_len ? lock_start + lock_len - 1 : -1;
+	if ((last >= 0 && le->start > last) ||
+	    (le->end >= 0 && le->end < lock_start))
+		return;
+#endif
+	if (le->waiting)
+		ct->waiting++;
+	else if (!ct->holders++)
+		ct->holder = lock_holder(le);
+}
+
+/* Find out who holds the lock and how many are waiting for it. */
+static void contention(int fd, struct contention *ct) {
+	memset(ct, 0, sizeof(*ct));
+	ct->holder = -1;
+	if (scan_locks(fd, count_lock, ct) == 0)
+		return;
+#ifndef USE_FLOCK
+	{
+		struct flock fl;
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_start = lock_start;
+		fl.l_len = nslots ? nslots : lock_len;
+		if (fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK) {
+			ct->holders = 1;
+			ct->holder = fl.l_pid > 0 ? fl.l_pid : -1;
+		}
+	}
+#endif
+}
+
+static void list_lock(const struct lockent *le, void *arg) {
+	int *n = arg;
+	pid_t pid = lock_holder(le);
+	++*n;
+	printf("%s\t%s\t%lld\t", le->waiting ? "waiting" : "held",
+		le->type, (long long)le->start);
+	if (le->end < 0)
+		printf("EOF\t");
+	else
+		printf("%lld\t", (long long)le->end);
+	if (pid > 0)
+		printf("%d\n", (int)pid);
+	else
+		printf("-\n");
+}
+
+/* With --stats and --log: what happened to the lock and how long it took. */
+static int want_stats;
+static const char *logfile;
+static int logfd = -1;
+static const char *keyname;
+static int contended;
+static struct contention seen;
+static double wait_time, hold_time = -1;
+
+static void report(const char *result, int status) {
+	char holder[32], line[1024], stamp[32];
+	time_t t = time(NULL);
+	int n;
+
+	if (contended && seen.holder > 0)
+		snprintf(holder, sizeof(holder), "%d", (int)seen.holder);
+	else
+		strcpy(holder, "-");
+	if (want_stats) {
+		fprintf(stderr, "%s: lockfile `%s' %s after waiting %.3fs",
+			progname, lckfile, result, wait_time);
+		if (contended) {
+			fprintf(stderr, " (held by %s%s",
+				seen.holder > 0 ? "process " : "",
+				seen.holder > 0 ? holder : "another process");
+			if (seen.holders > 1)
+				fprintf(stderr, " and %d more", seen.holders - 1);
+			fprintf(stderr, ", %d other%s waiting)",
+				seen.waiting, seen.waiting == 1 ? "" : "s");
+		}
+		if (hold_time >= 0)
+			fprintf(stderr, ", held for %.3fs", hold_time);
+		fputs("\n", stderr);
+	}
+	if (logfd < 0)
+		return;
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S%z", localtime(&t));
+	n = snprintf(line, sizeof(line),
+		"%s pid=%d lockfile=%s key=%s result=%s wait=%.6f hold=",
+		stamp, (int)getpid(), lckfile, keyname ? keyname : "-",
+		result, wait_time);
+	if (n < (int)sizeof(line)) {
+		if (hold_time >= 0)
+			n += snprintf(line + n, sizeof(line) - n, "%.6f", hold_time);
+		else
+			n += snprintf(line + n, sizeof(line) - n, "-");
+	}
+	if (n < (int)sizeof(line))
+		n += snprintf(line + n, sizeof(line) - n,
+			" holder=%s holders=%d waiting=%d status=%d\n",
+			holder, contended ? seen.holders : 0,
+			contended ? seen.waiting : 0, status);
+	if (n >= (int)sizeof(line)) {
+		n = sizeof(line) - 1;
+		line[n - 1] = '\n';
+	}
+	/* one write, so that lines from concurrent runs do not mix */
+	if (write(logfd, line, n) != n)
+		fprintf(stderr, "%s: unable to write log `%s': %s\n",
+			progname, logfile, strerror(errno));
+}
+
+/* Try for the lock for up to 'timeout' seconds, or for ever if it is
+ * negative. Between attempts, sleep
+ * for 1ms, doubling up to 100ms, but try again at once when the lock file
+ * is closed by anyone, as that is how locks are usually let go of. */
+static int timedlock(int fd, int shared, double timeout) {
+	double deadline = now() + timeout, backoff = 0.001, left;
+	struct timespec ts;
+	int in = -1, c, saved;
+	char buf[4096];
+#ifdef __linux__
+	struct pollfd pfd;
+
+	in = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (in >= 0 && inotify_add_watch(in, lckfile,
+			IN_CLOSE_WRITE | IN_CLOSE_NOWRITE | IN_DELETE_SELF) < 0) {
+		close(in);
+		in = -1;
+	}
+#endif
+
+	while ((c = lock(fd, shared, 0)) < 0 && busy(errno)) {
+		left = timeout < 0 ? backoff : deadline - now();
+		if (left <= 0)
+			break;
+		if (left > backoff)
+			left = backoff;
+		ts.tv_sec = left;
+		ts.tv_nsec = (left - ts.tv_sec) * 1e9;
+		backoff = backoff * 2 > 0.1 ? 0.1 : backoff * 2;
+#ifdef __linux__
+		if (in >= 0) {
+			pfd.fd = in;
+			pfd.events = POLLIN;
+			if (ppoll(&pfd, 1, &ts, NULL) > 0) {
+				while (read(in, buf, sizeof(buf)) > 0)
+					;
+				backoff = 0.001;
+			}
+			continue;
+		}
+#endif
+		nanosleep(&ts, NULL);
+	}
+
+	saved = errno;
+	if (in >= 0)
+		close(in);
+	errno = saved;
+	return c;
 }
 
+
 int main(int argc, char **argv) {
 	int fd;
 	int c;
 	int create = O_CREAT;
-	int dofork = 1;
-	int waittime = 0;
+	int dofork = -1;	/* unless -e or -f: only if the lock needs it */
+	double waittime = 0;	/* seconds; < 0 to wait for ever */
 	int shared = 0;
 	int test = 0;
 	int fdn = -1;
+	int all = 0;
+	double start;
 #ifndef USE_FLOCK
 	struct flock fl;
 #endif
+	enum { OPT_STATS = 256, OPT_LOG, OPT_ALL };
 
 	if ((progname = strrchr(argv[0], '/')) == NULL)
 		progname = argv[0];
@@ -82,32 +509,59 @@ int main(int argc, char **argv) {
 			" -w - if the lock is already held by another process,\n"
 			"   wait for it to complete instead of failing immediately\n"
 			" -W sec - the same as -w but wait not more than sec seconds\n"
+			"   (may be fractional)\n"
 			" -e - execute the program directly, no fork/wait\n"
-			"   (keeps extra open file descriptor)\n"
+			"   (keeps extra open file descriptor; the default when\n"
+			"   the lock is not lost if the program closes the file)\n"
+			" -f - fork and wait for the program, and keep no extra\n"
+			"   open file descriptor\n"
 			" -E nnn - set the fd# to keep open in -e case (implies -e)\n"
 			" -n - do not create the lock file if it does not exist\n"
 			" -q - produce no output if lock is already held\n"
 			" -s - lock in shared (read) mode\n"
 			" -x - lock in exclusive (write) mode (default)\n"
+#ifndef USE_FLOCK
+			" -N count - allow up to count programs to run at once,\n"
+			"   each holding one of count slots in the lock file\n"
+			"   (its number is passed in $LCKDO_SLOT)\n"
+			" -k, --key name - lock only a byte of the lock file,\n"
+			"   chosen by name, so many locks can share one file\n"
+#endif
 			" -t - test for lock existence"
 #ifndef USE_FLOCK
 			" (just prints pid if any with -q)\n"
 #endif
 			"   (implies -n)\n"
+			" -t --all - list all locks on the lock file, held or waited\n"
+			"   for, with the processes holding them\n"
+			" --stats - report the time spent waiting for and holding\n"
+			"   the lock, and who held it if it was taken\n"
+			" --log file - append the same to file, one line per run\n"
 		, progname, progname);
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "+wW:neE:sxtq")) != EOF) {
+	static const struct option longopts[] = {
+		{ "key", required_argument, NULL, 'k' },
+		{ "stats", no_argument, NULL, OPT_STATS },
+		{ "log", required_argument, NULL, OPT_LOG },
+		{ "all", no_argument, NULL, OPT_ALL },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((c = getopt_long(argc, argv, "+wW:neE:fsxtqN:k:", longopts, NULL)) != EOF) {
 		switch(c) {
 		case 'w':
 			if (!waittime)
 				waittime = -1;
 			break;
-		case 'W':
-			if ((waittime = atoi(optarg)) < 1)
+		case 'W': {
+			char *end;
+			waittime = strtod(optarg, &end);
+			if (end == optarg || *end || !(waittime > 0))
 				error(0, EX_USAGE, "invalid wait time `%s'", optarg);
 			break;
+		}
 		case 't':
 			test = 1;
 			/* fall thru */
@@ -121,6 +575,10 @@ int main(int argc, char **argv) {
 		case 'e':
 			dofork = 0;
 			break;
+		case 'f':
+			dofork = 1;
+			fdn = -1;
+			break;
 		case 's':
 			shared = 1;
 			break;
@@ -130,6 +588,30 @@ int main(int argc, char **argv) {
 		case 'q':
 			quiet = 1;
 			break;
+		case OPT_STATS:
+			want_stats = 1;
+			break;
+		case OPT_LOG:
+			logfile = optarg;
+			break;
+		case OPT_ALL:
+			all = 1;
+			break;
+#ifndef USE_FLOCK
+		case 'N': {
+			char *end;
+			long n = strtol(optarg, &end, 10);
+			if (end == optarg || *end || n < 1 || n > 1000000)
+				error(0, EX_USAGE, "invalid slot count `%s'", optarg);
+			nslots = n;
+			break;
+		}
+		case 'k':
+			lock_start = key_offset(optarg);
+			lock_len = 1;
+			keyname = optarg;
+			break;
+#endif
 		default:
 			return EX_USAGE;
 		}
@@ -140,6 +622,16 @@ int main(int argc, char **argv) {
 		error(0, EX_USAGE, "too few arguments given");
 
 	lckfile = *argv++;
+	if (nslots && shared)
+		error(0, EX_USAGE, "-N cannot be used with -s");
+	if (all && !test)
+		error(0, EX_USAGE, "--all can only be used with -t");
+
+	if (logfile && !test) {
+		logfd = open(logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+		if (logfd < 0)
+			error(errno, EX_CANTCREAT, "unable to open `%s'", logfile);
+	}
 
 #ifdef USE_FLOCK
 	create |= O_RDONLY;
@@ -168,14 +660,18 @@ int main(int argc, char **argv) {
 
 	if (test)
 		waittime = 0;
-	else if (waittime > 0) {
-		alarm(waittime);
-		signal(SIGALRM, sigalarm);
+	if (test && all) {
+		int n = 0;
+		if (scan_locks(fd, list_lock, &n) < 0)
+			error(errno, EX_OSERR, "unable to list locks");
+		if (!n && !quiet)
+			printf("lockfile `%s' is not locked\n", lckfile);
+		return n ? EX_TEMPFAIL : 0;
 	}
 #ifdef USE_FLOCK
-	c = flock(fd, (shared ? LOCK_SH : LOCK_EX) | (waittime ? 0 : LOCK_NB));
-	if (test && c < 0 &&
-		(errno == EWOULDBLOCK || errno == EAGAIN || errno == EACCES)) {
+	if (test)
+		c = lock(fd, shared, 0);
+	if (test && c < 0 && busy(errno)) {
 		if (!quiet)
 			printf("lockfile `%s' is locked\n", lckfile);
 		else
@@ -185,31 +681,102 @@ int main(int argc, char **argv) {
 #else
 	memset(&fl, 0, sizeof(fl));
 	fl.l_type = shared ? F_RDLCK : F_WRLCK;
-	c = fcntl(fd, test ? F_GETLK : waittime ? F_SETLKW : F_SETLK, &fl);
+	if (test && nslots) {
+		int i, taken = 0;
+		for (i = 0; i < nslots; i++) {
+			memset(&fl, 0, sizeof(fl));
+			fl.l_type = F_WRLCK;
+			fl.l_start = lock_start + i;
+			fl.l_len = 1;
+			if (fcntl(fd, F_GETLK, &fl) < 0)
+				error(errno, EX_OSERR, "unable to test `%s'", lckfile);
+			if (fl.l_type != F_UNLCK)
+				taken++;
+		}
+		if (!quiet)
+			printf("lockfile `%s' has %d of %d slots locked\n",
+				lckfile, taken, nslots);
+		else
+			printf("%d\n", taken);
+		return taken == nslots ? EX_TEMPFAIL : 0;
+	}
+	fl.l_start = lock_start;
+	fl.l_len = lock_len;
+	if (test)
+		c = fcntl(fd, F_GETLK, &fl);
 	if (test && c == 0) {
 		if (fl.l_type == F_UNLCK) {
 			if (!quiet)
 				printf("lockfile `%s' is not locked\n", lckfile);
 			return 0;
 		}
-		if (!quiet)
+		/* OFD locks have no owning process; look for one
+		 * that has the lock */
+		if (fl.l_pid <= 0) {
+			struct contention ct;
+			contention(fd, &ct);
+			fl.l_pid = ct.holder;
+		}
+		if (fl.l_pid <= 0) {
+			if (!quiet)
+				printf("lockfile `%s' is locked\n", lckfile);
+			else
+				printf("locked\n");
+		} else if (!quiet)
 			printf("lockfile `%s' is locked by process %d\n", lckfile, fl.l_pid);
 		else
 			printf("%d\n", fl.l_pid);
 		return EX_TEMPFAIL;
 	}
 #endif
-	if (waittime > 0)
-		alarm(0);
+	start = now();
+	if (!test && (want_stats || logfd >= 0)) {
+		/* try once without waiting, to see who is in the way */
+		c = lock(fd, shared, 0);
+		if (c < 0 && busy(errno)) {
+			double scan = now();
+			contended = 1;
+			contention(fd, &seen);
+			/* time spent looking is not time spent waiting */
+			start += now() - scan;
+			errno = EAGAIN;
+		}
+	}
+	if (!test && ((!want_stats && logfd < 0) || (contended && waittime != 0))) {
+		if (waittime > 0 || (waittime < 0 && nslots))
+			c = timedlock(fd, shared, waittime);
+		else
+			c = lock(fd, shared, waittime != 0);
+	}
+	wait_time = now() - start;
 	if (c < 0) {
-		if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EACCES)
+		if (!busy(errno))
 			error(errno, EX_OSERR, "unable to lock `%s'", lckfile);
-		else if (quiet)
+		report(waittime > 0 ? "timed out" : "busy", EX_TEMPFAIL);
+		if (quiet)
 			return EX_TEMPFAIL;
+		else if (waittime > 0)
+			error(0, EX_TEMPFAIL,
+				"lock file `%s' is already locked (timeout waiting)",
+				lckfile);
+		else if (nslots)
+			error(0, EX_TEMPFAIL, "all %d slots of lockfile `%s' are locked",
+				nslots, lckfile);
 		else
 			error(0, EX_TEMPFAIL, "lockfile `%s' is already locked", lckfile);
 	}
 
+	if (slot >= 0) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%d", slot);
+		if (setenv("LCKDO_SLOT", buf, 1) < 0)
+			error(errno, EX_OSERR, "setenv() failed");
+	}
+
+	/* the lock is only known to be let go of when the program exits */
+	if (dofork < 0)
+		dofork = !ofd || want_stats || logfd >= 0;
+	start = now();
 	if (dofork) {
 		pid_t pid;
 		int flags = fcntl(fd, F_GETFD, 0);
@@ -222,12 +789,18 @@ int main(int argc, char **argv) {
 		else if (pid) {
 			if (wait(&c) < 0)
 				error(errno, EX_OSERR, "wait() failed");
+			hold_time = now() - start;
+			report("acquired", WIFSIGNALED(c) ?
+				128 + WTERMSIG(c) : WEXITSTATUS(c));
 			if (WIFSIGNALED(c))
 				error(0, EX_SOFTWARE, "%s: %s", *argv,
 						strsignal(WTERMSIG(c)));
 			return WEXITSTATUS(c);
 		}
 	}
+	/* with -e, all that is known is that the lock was taken */
+	if (!dofork)
+		report("acquired", 0);
 	execvp(*argv, argv);
 	error(errno, EX_OSERR, "unable to execute %s", *argv);
 }
@@ -26,8 +26,10 @@
  */
 
 /*
- * Usage: mispipe <command1> <command2>
- * Run <command1> | <command2>, but return with the exit status of <command1>.
+ * Usage: mispipe [-t] [-s first|last|first-failing|mask] [-p size] [-b size]
+ *                <command1> <command2> ...
+ * Run <command1> | <command2> | ..., but return with the exit status of
+ * <command1>, or as chosen with -s.
  *
  * This is designed for a very specific purpose: logging.
  * "foo | logger -t foo"
@@ -36,22 +38,70 @@
  * will return with the exit status of foo.
  */
 
-/*
- * To do:
- * Make this into a fancy, internationalized, option-handling hellbeast.
- * (But why bother?  It does its job quite well.)
- */
-
+#define _GNU_SOURCE /* pipe2(), wait4() */
 #include <errno.h> /* errno */
 #include <sys/types.h>
-#include <unistd.h> /* pipe(), fork(),... */
-#include <stdlib.h> /* system() */
-#include <sys/wait.h> /* waitpid(), etc. */
+#include <unistd.h> /* pipe2(), close(),... */
+#include <fcntl.h> /* O_CLOEXEC */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h> /* clock_gettime() */
+#include <sys/wait.h> /* wait4(), etc. */
+#include <sys/resource.h> /* struct rusage */
 #include <stdio.h>
 #include <stdarg.h> /* va_list, for error() */
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h> /* SYS_pidfd_open */
+#endif
+
+#include "pipeutil.c" /* spawn_command(), parse_size(), grow_pipe() */
 
 static const char* progname; /* Stores argv[0] */
-static int filedes[2]; /* Stores pipe file descriptors */
+
+/* One command in the pipeline. */
+struct stage {
+	const char* cmd;
+	pid_t pid;
+	int pidfd; /* -1 if not waiting with a pidfd */
+	int status_big; /* 'wait' style */
+	int done;
+	struct timespec start, end;
+	struct rusage usage;
+};
+
+static struct stage* stages;
+static int nstages;
+
+/* Which exit status to return. */
+enum { STATUS_FIRST, STATUS_LAST, STATUS_FIRST_FAILING, STATUS_MASK };
+
+/*
+ * With -b, each command writes into a pipe that we read, and we pass the
+ * data on through another pipe to the next command, buffering as much as
+ * it lags behind: up to relay_size bytes in memory, and the rest, up
+ * to relay_spill bytes, in a temporary file. Data in the file is always
+ * older than the data read after it, which goes on to the file too until
+ * the file is drained. Once the file is full, we stop reading, and the
+ * command has to wait, as it would for a full pipe.
+ */
+struct relay {
+	int in, out; /* -1 once closed */
+	int reading; /* in is being watched */
+	char* mem;
+	size_t start, len; /* of the data in mem */
+	int spill; /* temporary file, or -1 */
+	off_t spill_start, spill_len;
+	int eof;
+};
+
+static struct relay* relays;
+static int nrelays;
+static size_t relay_size;
+static off_t relay_spill;
+
+enum { RELAY_CHUNK = 64 * 1024 };
 
 /* Subroutine for 'warning' and 'error' which prefixes progname */
 static void warning_prefix(void) {
@@ -98,82 +148,490 @@ static int shorten_status(int status_big) {
 	error("shorten_status got an invalid status (?!)");
 }
 
-/* All the work for command 2. */
+/* Start a command with 'in' and 'out' as its standard input and
+ * output, as spawn_command() does. */
+static pid_t spawn(const char* cmd, int in, int out) {
+	pid_t pid;
+	int err;
+
+	err = spawn_command(&pid, cmd, in, out);
+	if (err) {
+		errno = err;
+		error_with_errno("posix_spawn() failed");
+	}
+	return pid;
+}
+
+/* Note that a stage has exited, with its status and resource usage. */
+static void reap(struct stage* st, int status_big, struct rusage* usage) {
+	st->status_big = status_big;
+	st->usage = *usage;
+	st->done = 1;
+	clock_gettime(CLOCK_MONOTONIC, &st->end);
+	if (st->pidfd != -1)
+		close(st->pidfd);
+}
+
+/* Reap stages in whatever order they exit, until there are none left,
+ * or with WNOHANG, until none has exited. Returns how many are left. */
+static int wait_any(int left, int flags) {
+	struct rusage usage;
+	int status_big, i;
+	pid_t pid;
+
+	while (left > 0) {
+		pid = wait4(-1, &status_big, flags, &usage);
+		if (pid == 0)
+			break;
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			error_with_errno("wait4() failed");
+		}
+		for (i = 0; i < nstages; i++) {
+			if (stages[i].pid == pid && !stages[i].done) {
+				reap(&stages[i], status_big, &usage);
+				left--;
+			}
+		}
+	}
+	return left;
+}
+
+#ifdef __linux__
+/* Stop relaying: the next command has gone, so let the one before find
+ * that out the way it would without us. */
+static void relay_close(struct relay* r) {
+	if (r->in != -1)
+		close(r->in);
+	if (r->out != -1)
+		close(r->out);
+	if (r->spill != -1)
+		close(r->spill);
+	r->in = r->out = r->spill = -1;
+	r->reading = 0;
+	free(r->mem);
+	r->mem = NULL;
+}
+
+/* Take what there is to read, into memory if it fits and nothing is
+ * waiting in the file, otherwise onto the end of the file. */
+static void relay_read(struct relay* r) {
+	char chunk[RELAY_CHUNK];
+	ssize_t n;
+	int reads;
+
+	/* Come back for more later, rather than let a fast writer keep
+	 * us from passing anything on. */
+	for (reads = 0; reads < 16 && r->spill_len < relay_spill; reads++) {
+		if (r->spill_len == 0 && r->start + r->len == relay_size &&
+		    r->start > 0) {
+			memmove(r->mem, r->mem + r->start, r->len);
+			r->start = 0;
+		}
+		if (r->spill_len == 0 && r->start + r->len < relay_size)
+			n = read(r->in, r->mem + r->start + r->len,
+				 relay_size - r->start - r->len);
+		else
+			n = read(r->in, chunk, sizeof chunk);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			close(r->in);
+			r->in = -1;
+			r->reading = 0;
+			r->eof = 1;
+			return;
+		}
+		if (r->spill_len == 0 && r->start + r->len < relay_size) {
+			r->len += n;
+			continue;
+		}
+		if (r->spill == -1) {
+			FILE* f = tmpfile();
+			if (f == NULL)
+				error_with_errno("tmpfile() failed");
+			r->spill = dup(fileno(f));
+			fclose(f);
+			if (r->spill == -1)
+				error_with_errno("dup() failed");
+		}
+		if (pwrite(r->spill, chunk, n, r->spill_start + r->spill_len)
+		    != n)
+			error_with_errno("Failed writing the buffer file");
+		r->spill_len += n;
+	}
+}
+
+/* Pass on what the next command will take, refilling memory from the
+ * file as it empties. */
+static void relay_write(struct relay* r) {
+	ssize_t n;
+
+	for (;;) {
+		if (r->len == 0 && r->spill_len > 0) {
+			r->start = 0;
+			n = pread(r->spill, r->mem,
+				  r->spill_len < (off_t)relay_size ?
+				  (size_t)r->spill_len : relay_size,
+				  r->spill_start);
+			if (n <= 0)
+				error_with_errno("Failed reading the buffer file");
+			r->len = n;
+			r->spill_start += n;
+			r->spill_len -= n;
+			if (r->spill_len == 0) {
+				r->spill_start = 0;
+				if (ftruncate(r->spill, 0))
+					error_with_errno("Failed truncating "
+							 "the buffer file");
+			}
+		}
+		if (r->len == 0)
+			break;
+		n = write(r->out, r->mem + r->start, r->len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return;
+		if (n == -1) {
+			relay_close(r);
+			return;
+		}
+		r->start += n;
+		r->len -= n;
+		if (r->len == 0)
+			r->start = 0;
+	}
+	if (r->eof) {
+		/* All passed on; the next command sees EOF. */
+		relay_close(r);
+	}
+}
+
+/* Watch for what the relay can do next. While it is full, its input
+ * is not watched at all, as a hangup would still be reported. */
+static void relay_watch(int epfd, int j) {
+	struct relay* r = &relays[j];
+	struct epoll_event ev;
+	int want;
+
+	if (r->out == -1)
+		return;
+	ev.events = r->len || r->spill_len ? EPOLLOUT : 0;
+	ev.data.u32 = nstages + 2 * j + 1;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, r->out, &ev);
+
+	want = r->in != -1 && r->spill_len < relay_spill;
+	if (want == r->reading)
+		return;
+	ev.events = EPOLLIN;
+	ev.data.u32 = nstages + 2 * j;
+	if (epoll_ctl(epfd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, r->in, &ev)
+	    == -1)
+		error_with_errno("epoll_ctl() failed");
+	r->reading = want;
+}
+
+static int relays_active(void) {
+	int j, active = 0;
+
+	for (j = 0; j < nrelays; j++)
+		if (relays[j].out != -1)
+			active++;
+	return active;
+}
+#endif
+
+/*
+ * Supervise the pipeline until every stage has exited and every relay
+ * has passed on all its data. Where the kernel has pidfds, each stage is
+ * watched through one in an epoll set alongside the relays' pipes, and
+ * is reaped as soon as it exits; otherwise, fall back to wait4(-1),
+ * polling it if there are relays to keep going.
+ */
+static void supervise(void) {
+	int left = nstages;
+#ifdef __linux__
+	struct epoll_event evs[16], ev;
+	struct rusage usage;
+	int epfd, status_big, i, j, n, k, pidfds = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		if (nrelays)
+			error_with_errno("epoll_create1() failed");
+		wait_any(left, 0);
+		return;
+	}
+#ifdef SYS_pidfd_open
+	for (i = 0; i < nstages; i++) {
+		stages[i].pidfd = syscall(SYS_pidfd_open, stages[i].pid, 0);
+		if (stages[i].pidfd == -1)
+			break;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, stages[i].pidfd, &ev) == -1)
+			break;
+	}
+	pidfds = i == nstages;
+#endif
+	if (!pidfds) {
+		/* No pidfds here (or too few file descriptors). */
+		for (i = 0; i < nstages; i++) {
+			if (stages[i].pidfd != -1) {
+				close(stages[i].pidfd);
+				stages[i].pidfd = -1;
+			}
+		}
+		if (!nrelays) {
+			close(epfd);
+			wait_any(left, 0);
+			return;
+		}
+	}
+	for (j = 0; j < nrelays; j++) {
+		ev.events = EPOLLIN;
+		ev.data.u32 = nstages + 2 * j;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, relays[j].in, &ev) == -1)
+			error_with_errno("epoll_ctl() failed");
+		relays[j].reading = 1;
+		ev.events = 0;
+		ev.data.u32 = nstages + 2 * j + 1;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, relays[j].out, &ev) == -1)
+			error_with_errno("epoll_ctl() failed");
+	}
+
+	while (left > 0 || relays_active()) {
+		if (!pidfds)
+			left = wait_any(left, WNOHANG);
+		n = epoll_wait(epfd, evs, 16, pidfds ? -1 : 50);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			error_with_errno("epoll_wait() failed");
+		}
+		for (k = 0; k < n; k++) {
+			i = evs[k].data.u32;
+			if (i >= nstages) {
+				j = (i - nstages) / 2;
+				/* The next command has gone. This is reported
+				 * even when not asked for, so stop watching
+				 * now rather than spin on it. */
+				if ((i - nstages) % 2 == 1 &&
+				    (evs[k].events & (EPOLLERR | EPOLLHUP))) {
+					relay_close(&relays[j]);
+					continue;
+				}
+				if ((i - nstages) % 2 == 0 && relays[j].in != -1)
+					relay_read(&relays[j]);
+				if (relays[j].out != -1)
+					relay_write(&relays[j]);
+				relay_watch(epfd, j);
+				continue;
+			}
+			if (wait4(stages[i].pid, &status_big, WNOHANG, &usage)
+			    != stages[i].pid)
+				continue;
+			epoll_ctl(epfd, EPOLL_CTL_DEL, stages[i].pidfd, NULL);
+			reap(&stages[i], status_big, &usage);
+			left--;
+		}
+	}
+	close(epfd);
+#else
+	wait_any(left, 0);
+#endif
+}
+
+static double seconds(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Print how long each stage took, and how it exited. */
+static void print_times(void) {
+	struct stage* st;
+	double real;
+	int i;
+
+	for (i = 0; i < nstages; i++) {
+		st = &stages[i];
+		real = (st->end.tv_sec - st->start.tv_sec)
+			+ (st->end.tv_nsec - st->start.tv_nsec) / 1e9;
+		warning_prefix();
+		fprintf(stderr, "stage %i: status %i, %.3fs real, "
+			"%.3fs user, %.3fs sys: %s\n", i + 1,
+			shorten_status(st->status_big), real,
+			seconds(st->usage.ru_utime),
+			seconds(st->usage.ru_stime), st->cmd);
+	}
+}
+
+/* The exit status to return, as chosen with -s. */
+static int pipeline_status(int which) {
+	int i, status, mask = 0;
+
+	switch (which) {
+	case STATUS_LAST:
+		return shorten_status(stages[nstages - 1].status_big);
+	case STATUS_FIRST_FAILING:
+		for (i = 0; i < nstages; i++) {
+			status = shorten_status(stages[i].status_big);
+			if (status != 0)
+				return status;
+		}
+		return 0;
+	case STATUS_MASK:
+		/* Bit n for stage n+1; bit 7 also stands for all later
+		 * stages, as there are no more bits. */
+		for (i = 0; i < nstages; i++) {
+			if (shorten_status(stages[i].status_big) != 0)
+				mask |= 1 << (i < 7 ? i : 7);
+		}
+		return mask;
+	default:
+		return shorten_status(stages[0].status_big);
+	}
+}
+
 __attribute__(( noreturn ))
-static void subprocess2(const char* cmd) {
-	/* Close the old standard input. */
-	if (close(0))
-		error_with_errno("Failed (in child) closing standard input");
-	/* Make the reading end of the pipe the new standard input. */
-	if (dup2(filedes[0], 0) == -1)
-		error_with_errno("Failed (in child) redefining standard input");
-	/* Close the original file descriptor for it */
-	if (close(filedes[0]))
-		error_with_errno("Failed (in child) closing filedes[0]");
-	/* Close the other end of the pipe. */
-	if (close(filedes[1]))
-		error_with_errno("Failed (in child) closing filedes[1]");
-	/* Do the second command, and throw away the exit status. */
-	system(cmd);
-	/* Close the standard input. */
-	if (close(0))
-		error_with_errno("Failed (in child) closing standard output "
-			" (while cleaning up)");
-	exit(0);
-}
-
-int main (int argc, const char ** argv) {
-	int status_big; /* Exit status, 'wait' and 'system' style */
-	pid_t child2_pid;
-	pid_t dead_pid;
+static void usage(void) {
+	error("Usage: mispipe [-t] [-s first|last|first-failing|mask] "
+	      "[-p size] [-b size [-B size]] command1 command2 ...\n");
+}
+
+int main (int argc, char ** argv) {
+	int (*filedes)[2]; /* Stores pipe file descriptors */
+	int npipes;
+	int which = STATUS_FIRST, timing = 0;
+	size_t pipe_size = 0;
+	int opt, i, in, out, failed;
 
 	/* Set progname */
 	progname = argv[0];
 
+	while ((opt = getopt(argc, argv, "+s:tp:b:B:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (strcmp(optarg, "first") == 0)
+				which = STATUS_FIRST;
+			else if (strcmp(optarg, "last") == 0)
+				which = STATUS_LAST;
+			else if (strcmp(optarg, "first-failing") == 0)
+				which = STATUS_FIRST_FAILING;
+			else if (strcmp(optarg, "mask") == 0)
+				which = STATUS_MASK;
+			else
+				usage();
+			break;
+		case 't':
+			timing = 1;
+			break;
+		case 'p':
+			pipe_size = parse_size(optarg);
+			if (!pipe_size)
+				error("Invalid pipe size %s\n", optarg);
+			break;
+		case 'b':
+			relay_size = parse_size(optarg);
+			if (!relay_size)
+				error("Invalid buffer size %s\n", optarg);
+			break;
+		case 'B':
+			relay_spill = parse_size(optarg);
+			if (!relay_spill)
+				error("Invalid buffer file size %s\n", optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+#ifndef __linux__
+	if (relay_size)
+		error("-b is not supported on this system\n");
+#endif
+	if (relay_spill && !relay_size)
+		error("-B needs -b\n");
+	if (!relay_spill)
+		relay_spill = (off_t)relay_size * 16;
+
 	/* Verify arguments */
-	if (argc != 3) 
+	nstages = argc - optind;
+	if (nstages < 2)
 		error("Wrong number of args, aborting\n");
-	/* Open a new pipe */
-	if (pipe(filedes))
-		error_with_errno("pipe() failed");
-
-	/* Fork to run second command */
-	child2_pid = fork();
-	if (child2_pid == 0)
-		subprocess2(argv[2]);
-	if (child2_pid == -1)
-		error_with_errno("fork() failed");
-
-	/* Run first command inline (seriously!) */
-	/* Close standard output. */
-	if (close(1))
-		error_with_errno("Failed closing standard output");
-	/* Make the writing end of the pipe the new standard output. */
-	if (dup2(filedes[1], 1) == -1)
-		error_with_errno("Failed redefining standard output");
-	/* Close the original file descriptor for it. */
-	if (close(filedes[1]))
-		error_with_errno("Failed closing filedes[1]");
-	/* Close the other end of the pipe. */
-	if (close(filedes[0]))
-		error_with_errno("Failed closing filedes[0]");
-	/* Do the first command, and (crucially) get the status. */
-	status_big = system(argv[1]);
-
-	/* Close standard output. */
-	if (close(1))
-		error_with_errno("Failed closing standard output (while cleaning up)");
-
-	/* Wait for the other process to exit. */
-	/* We don't care about the status. */
-	dead_pid = waitpid(child2_pid, NULL, WUNTRACED);
-	if (dead_pid == -1) {
-		error_with_errno("waitpid() failed");
-	}
-	else if (dead_pid != child2_pid) {
-		error("waitpid(): Who died? %i\n", dead_pid);
+	/* With relays, there are two pipes between each pair of stages:
+	 * pipe 2i into relay i and pipe 2i+1 out of it. */
+	nrelays = relay_size ? nstages - 1 : 0;
+	npipes = relay_size ? 2 * (nstages - 1) : nstages - 1;
+	stages = calloc(nstages, sizeof *stages);
+	relays = calloc(nrelays + 1, sizeof *relays);
+	filedes = calloc(npipes, sizeof *filedes);
+	if (!stages || !relays || !filedes)
+		error("Out of memory\n");
+
+	/* Open the pipes between stages. Neither end leaks into the
+	 * commands except as the standard output or input it is made
+	 * into. */
+	for (i = 0; i < npipes; i++) {
+		if (pipe2(filedes[i], O_CLOEXEC))
+			error_with_errno("pipe2() failed");
+		if (pipe_size)
+			grow_pipe(filedes[i][1], pipe_size);
+	}
+	for (i = 0; i < nrelays; i++) {
+		relays[i].in = filedes[2 * i][0];
+		relays[i].out = filedes[2 * i + 1][1];
+		relays[i].spill = -1;
+		relays[i].mem = malloc(relay_size);
+		if (!relays[i].mem)
+			error("Out of memory\n");
+		if (fcntl(relays[i].in, F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(relays[i].out, F_SETFL, O_NONBLOCK) == -1)
+			error_with_errno("fcntl() failed");
+	}
+
+	/* Like system(), ignore interrupts while the commands run, so
+	 * that ^C is left to them and we still report on it. A relay
+	 * finds out that the next command has gone from EPIPE. */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Start the readers before the writers. */
+	for (i = nstages - 1; i >= 0; i--) {
+		if (relay_size) {
+			in = i > 0 ? filedes[2 * i - 1][0] : -1;
+			out = i < nstages - 1 ? filedes[2 * i][1] : -1;
+		} else {
+			in = i > 0 ? filedes[i - 1][0] : -1;
+			out = i < nstages - 1 ? filedes[i][1] : -1;
+		}
+		stages[i].cmd = argv[optind + i];
+		stages[i].pidfd = -1;
+		clock_gettime(CLOCK_MONOTONIC, &stages[i].start);
+		stages[i].pid = spawn(stages[i].cmd, in, out);
 	}
 
+	/* Close our copies of the commands' ends of the pipes, so each
+	 * command sees EOF when the one before it is done. */
+	for (i = 0; i < npipes; i++) {
+		if (relay_size && i % 2 == 0)
+			failed = close(filedes[i][1]);
+		else if (relay_size)
+			failed = close(filedes[i][0]);
+		else
+			failed = close(filedes[i][0]) || close(filedes[i][1]);
+		if (failed)
+			error_with_errno("Failed closing a pipe");
+	}
+
+	supervise();
+
+	if (timing)
+		print_times();
+
 	/* Return the desired exit status. */
-	return shorten_status(status_big);
+	return pipeline_status(which);
 }
@@ -1,8 +1,20 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "pipeutil.c"
+
 /* Licensed under the GPL
  * Copyright (c) Miek Gieben, 2006
  */
@@ -11,51 +23,502 @@
  * pipes _and_ output to standard output
  */
 
-int
-close_pipes(FILE **p, size_t i) 
+#define DEFAULT_BUFSIZE (1024 * 1024)
+
+struct consumer {
+	const char *cmd;
+	pid_t pid;
+	int fd;		/* write end of the pipe to the command, or -1 */
+	int pipesize;	/* achieved pipe buffer size, or -1 if unknown */
+	int status;	/* exit status, as returned by waitpid() */
+	int dropped;	/* closed its end before all input was written */
+	char *out;	/* records queued for this command in split mode */
+	size_t outlen;
+	unsigned long long written;	/* bytes written to the command */
+	double blocked;	/* seconds spent in write() to the command */
+	double writing_since;	/* start of the write in progress, or 0 */
+};
+
+enum split_mode { SPLIT_NONE, SPLIT_RR, SPLIT_HASH };
+
+static struct consumer *consumers;
+static size_t nconsumers, active;
+static int ignore_write_errors = 0;
+
+/* For --stats and SIGUSR1. */
+static volatile sig_atomic_t stats_requested = 0;
+static double start_time;
+static unsigned long long input_bytes;
+static double input_blocked;	/* seconds spent waiting for input */
+
+void
+usage() {
+	printf("Usage: pee [-ivz] [-b size] [-s rr|hash:field] "
+	       "[--ignore-write-errors] [--verbose]\n"
+	       "           [--bufsize=size] [--split=rr|hash:field] [--null] "
+	       "[--stats]\n"
+	       "           [\"command\" ...]\n");
+	exit(EXIT_FAILURE);
+}
+
+double
+now(void)
 {
-	int ret=EXIT_SUCCESS;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+request_stats(int sig)
+{
+	stats_requested = 1;
+}
+
+/* Print, for the input and for each command, how much data has gone
+ * through and how long we were blocked on it. A command whose pipe stays
+ * full and that accounts for most of the blocked time is the one holding
+ * the others back. */
+void
+dump_stats(void)
+{
+	double elapsed = now() - start_time;
 	size_t j;
-	for (j = 0; j < i; j++) {
-		int r = pclose(p[j]);
-		if (WIFEXITED(r))
-			ret |= WEXITSTATUS(r);
+	int queued;
+
+	stats_requested = 0;
+	fprintf(stderr, "pee: %.3fs elapsed, input: %llu bytes, "
+		"%.3fs waiting for input\n",
+		elapsed, input_bytes, input_blocked);
+	for (j = 0; j < nconsumers; j++) {
+		struct consumer *c = &consumers[j];
+
+		fprintf(stderr, "pee: `%s': %llu bytes", c->cmd, c->written);
+		if (elapsed > 0)
+			fprintf(stderr, " (%.1f MB/s)",
+				c->written / elapsed / 1e6);
+		fprintf(stderr, ", %.3fs blocked", c->blocked +
+			(c->writing_since ? now() - c->writing_since : 0));
+		if (c->fd < 0)
+			fprintf(stderr, ", closed\n");
+		else if (ioctl(c->fd, FIONREAD, &queued) == 0)
+			fprintf(stderr, ", %d bytes queued\n", queued);
 		else
-			ret |= 1;
+			fputc('\n', stderr);
 	}
-	return ret;
 }
 
+/* Fill buf with up to size bytes from fd. Blocks only for the first read;
+ * after that it takes whatever is immediately available, so a fast
+ * producer yields large buffers while a slow one is not held back.
+ * Returns the number of bytes read, 0 at EOF, -1 on error. */
+ssize_t
+fill_buffer(int fd, char *buf, size_t size)
+{
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t r;
+	double t;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		t = now();
+		r = read(fd, buf + len, size - len);
+		input_blocked += now() - t;
+		if (stats_requested)
+			dump_stats();
+		/* interrupted, as by SIGUSR1 for --stats: read again */
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		len += r;
+		if (len == size || poll(&pfd, 1, 0) != 1 ||
+		    (pfd.revents & (POLLHUP | POLLERR)))
+			break;
+	}
+	input_bytes += len;
+	if (r < 0 && !len)
+		return -1;
+	return len;
+}
+
+/* Write all of buf to fd. Returns 0, or -1 with errno set. */
 int
-main(int argc, char **argv) {
-	size_t i, r;
-	FILE **pipes;
-	char buf[BUFSIZ];
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t w;
 
-	pipes = malloc(((argc - 1) * sizeof *pipes));
-	if (!pipes) 
-		exit(EXIT_FAILURE);
+	while (len > 0) {
+		w = write(fd, buf, len);
+		if (stats_requested)
+			dump_stats();
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/* Start cmd with its standard input connected to a new pipe, as
+ * spawn_command() does. Returns 0, or an errno value. */
+int
+start_consumer(struct consumer *c)
+{
+	int fds[2];
+	int err;
+
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return errno;
+	err = spawn_command(&c->pid, c->cmd, fds[0], -1);
+	close(fds[0]);
+	if (err) {
+		close(fds[1]);
+		return err;
+	}
+	c->fd = fds[1];
+	return 0;
+}
+
+int
+close_consumer(struct consumer *c)
+{
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+		while (waitpid(c->pid, &c->status, 0) < 0) {
+			if (errno != EINTR) {
+				c->status = -1;
+				break;
+			}
+		}
+	}
+	if (c->status != -1 && WIFEXITED(c->status))
+		return WEXITSTATUS(c->status);
+	return 1;
+}
+
+int
+close_pipes(struct consumer *c, size_t n)
+{
+	int ret=EXIT_SUCCESS;
+	size_t j;
+	for (j = 0; j < n; j++)
+		ret |= close_consumer(&c[j]);
+	return ret;
+}
+
+void
+report(struct consumer *c, size_t n)
+{
+	size_t j;
+	for (j = 0; j < n; j++) {
+		fprintf(stderr, "pee: `%s': ", c[j].cmd);
+		if (c[j].status == -1)
+			fprintf(stderr, "could not be waited for");
+		else if (WIFEXITED(c[j].status))
+			fprintf(stderr, "exit status %d",
+				WEXITSTATUS(c[j].status));
+		else if (WIFSIGNALED(c[j].status))
+			fprintf(stderr, "killed by signal %d",
+				WTERMSIG(c[j].status));
+		if (c[j].dropped)
+			fprintf(stderr, " (closed its input early)");
+		fputc('\n', stderr);
+	}
+}
 
-	for (i = 1; i < argc; i++) {
-		pipes[i - 1] = popen(argv[i], "w");
-		if (!pipes[i - 1]) {
-			fprintf(stderr, "Can not open pipe to '%s\'\n", argv[i]);
-			close_pipes(pipes, i);
+/* Send len bytes to consumer c. A consumer that has gone away is dropped
+ * if write errors are being ignored; any other failure is fatal. */
+void
+feed(struct consumer *c, const char *buf, size_t len)
+{
+	double t;
+	int r;
+
+	if (c->fd < 0 || len == 0)
+		return;
+	c->writing_since = t = now();
+	r = write_all(c->fd, buf, len);
+	c->blocked += now() - t;
+	c->writing_since = 0;
+	if (r == 0) {
+		c->written += len;
+		return;
+	}
+	if (ignore_write_errors && errno == EPIPE) {
+		c->dropped = 1;
+		close_consumer(c);
+		active--;
+		return;
+	}
+	fprintf(stderr, "Write error to `%s\'\n", c->cmd);
+	close_pipes(consumers, nconsumers);
+	exit(EXIT_FAILURE);
+}
+
+/* Queue one record for consumer c, writing out its queue first when the
+ * record does not fit. Records larger than the queue go out directly. */
+void
+queue_record(struct consumer *c, const char *rec, size_t len, size_t bufsize)
+{
+	if (c->outlen + len > bufsize) {
+		feed(c, c->out, c->outlen);
+		c->outlen = 0;
+	}
+	if (len >= bufsize)
+		feed(c, rec, len);
+	else {
+		memcpy(c->out + c->outlen, rec, len);
+		c->outlen += len;
+	}
+}
+
+/* FNV-1a hash of the field'th blank-separated field of a record. */
+unsigned long
+hash_field(const char *rec, size_t len, int field)
+{
+	const unsigned char *p = (const unsigned char *)rec;
+	const unsigned char *end = p + len;
+	unsigned long h = 2166136261UL;
+
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (--field == 0 || p == end)
+			break;
+		while (p < end && *p != ' ' && *p != '\t')
+			p++;
+	}
+	while (p < end && *p != ' ' && *p != '\t' &&
+	       *p != '\n' && *p != '\0') {
+		h = (h ^ *p++) * 16777619UL;
+	}
+	return h;
+}
+
+/* Pick the consumer for the next record. Dropped consumers are skipped,
+ * so with hashing only the keys of a dropped consumer move elsewhere. */
+size_t
+pick_consumer(enum split_mode mode, int field, const char *rec, size_t len)
+{
+	static size_t next = 0;
+	size_t i;
+
+	if (mode == SPLIT_RR)
+		i = next++ % nconsumers;
+	else
+		i = hash_field(rec, len, field) % nconsumers;
+	while (consumers[i].fd < 0)
+		i = (i + 1) % nconsumers;
+	return i;
+}
+
+/* Distribute whole records from standard input across the consumers.
+ * Records are batched per consumer and each batch is written out once
+ * the input that is immediately available has been consumed. */
+ssize_t
+split_input(enum split_mode mode, int field, char delim, size_t bufsize)
+{
+	size_t cap = bufsize, have = 0, i;
+	char *buf, *p, *end, *eol;
+	ssize_t r;
 
+	buf = malloc(cap);
+	if (!buf)
+		exit(EXIT_FAILURE);
+	for (i = 0; i < nconsumers; i++) {
+		consumers[i].out = malloc(bufsize);
+		if (!consumers[i].out)
 			exit(EXIT_FAILURE);
+	}
+
+	do {
+		if (have == cap) {
+			/* a record longer than the buffer */
+			cap *= 2;
+			buf = realloc(buf, cap);
+			if (!buf)
+				exit(EXIT_FAILURE);
+		}
+		r = fill_buffer(0, buf + have, cap - have);
+		if (r > 0)
+			have += r;
+
+		p = buf;
+		end = buf + have;
+		while (active && (eol = memchr(p, delim, end - p))) {
+			eol++;
+			i = pick_consumer(mode, field, p, eol - p);
+			queue_record(&consumers[i], p, eol - p, bufsize);
+			p = eol;
 		}
+		if (r <= 0 && p < end && active) {
+			/* final record without a delimiter */
+			i = pick_consumer(mode, field, p, end - p);
+			queue_record(&consumers[i], p, end - p, bufsize);
+			p = end;
+		}
+		have = end - p;
+		memmove(buf, p, have);
+
+		for (i = 0; i < nconsumers; i++) {
+			feed(&consumers[i], consumers[i].out,
+			     consumers[i].outlen);
+			consumers[i].outlen = 0;
+		}
+	} while (r > 0 && active);
+
+	free(buf);
+	return r;
+}
+
+/* Copy standard input to every consumer. */
+ssize_t
+broadcast_input(size_t bufsize)
+{
+	char *buf;
+	ssize_t r;
+	size_t i;
+
+	buf = malloc(bufsize);
+	if (!buf)
+		exit(EXIT_FAILURE);
+	while ((r = fill_buffer(0, buf, bufsize)) > 0) {
+		for (i = 0; i < nconsumers; i++)
+			feed(&consumers[i], buf, r);
+		if (nconsumers && !active)
+			break;
 	}
-	argc--;
-	
-	while(!feof(stdin) && (!ferror(stdin))) {
-		r = fread(buf, sizeof(char), BUFSIZ, stdin);
-		for(i = 0; i < argc; i++) {
-			if (fwrite(buf, sizeof(char), r, pipes[i]) != r) {
-				fprintf(stderr, "Write error to `%s\'\n", argv[i + 1]);
-				close_pipes(pipes, i);
+	free(buf);
+	return r;
+}
+
+int
+main(int argc, char **argv) {
+	size_t i;
+	ssize_t r;
+	size_t bufsize = DEFAULT_BUFSIZE;
+	enum split_mode split = SPLIT_NONE;
+	int field = 0;
+	char delim = '\n';
+	char *end;
+	int verbose = 0;
+	int stats = 0;
+	int ret;
+	int opt;
+	int err;
+	struct sigaction sa;
+	struct option options[] = {
+		{ "bufsize", required_argument, NULL, 'b' },
+		{ "ignore-write-errors", no_argument, NULL, 'i' },
+		{ "split", required_argument, NULL, 's' },
+		{ "stats", no_argument, NULL, 'S' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "null", no_argument, NULL, 'z' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "+b:is:vz", options, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			bufsize = parse_size(optarg);
+			if (!bufsize) {
+				fprintf(stderr, "pee: invalid buffer size `%s'\n",
+					optarg);
 				exit(EXIT_FAILURE);
 			}
+			break;
+		case 'i':
+			ignore_write_errors = 1;
+			break;
+		case 's':
+			if (strcmp(optarg, "rr") == 0)
+				split = SPLIT_RR;
+			else if (strncmp(optarg, "hash:", 5) == 0) {
+				split = SPLIT_HASH;
+				field = strtol(optarg + 5, &end, 10);
+			}
+			if (split == SPLIT_NONE ||
+			    (split == SPLIT_HASH && (*end || field < 1))) {
+				fprintf(stderr, "pee: invalid split mode `%s'\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'z':
+			delim = '\0';
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	nconsumers = argc;
+	if (split != SPLIT_NONE && !nconsumers)
+		usage();
+
+	consumers = calloc(nconsumers ? nconsumers : 1, sizeof *consumers);
+	if (!consumers)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < nconsumers; i++) {
+		consumers[i].cmd = argv[i];
+		err = start_consumer(&consumers[i]);
+		if (err) {
+			fprintf(stderr, "Can not open pipe to '%s\': %s\n",
+				argv[i], strerror(err));
+			close_pipes(consumers, i);
+
+			exit(EXIT_FAILURE);
 		}
+		consumers[i].pipesize = grow_pipe(consumers[i].fd, bufsize);
+		if (verbose && consumers[i].pipesize > 0)
+			fprintf(stderr, "pee: `%s': pipe size %d bytes\n",
+				argv[i], consumers[i].pipesize);
 	}
-	exit(close_pipes(pipes, argc));
+
+	/* Only now, so that the commands still get the default SIGPIPE
+	 * disposition: a consumer that goes away then shows up as EPIPE
+	 * from write instead of killing us. */
+	if (ignore_write_errors)
+		signal(SIGPIPE, SIG_IGN);
+
+	/* No SA_RESTART: a SIGUSR1 that arrives while blocked on a full
+	 * pipe interrupts the write, so the statistics are printed then. */
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = request_stats;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	start_time = now();
+
+	active = nconsumers;
+	if (split == SPLIT_NONE)
+		r = broadcast_input(bufsize);
+	else
+		r = split_input(split, field, delim, bufsize);
+	if (r < 0)
+		perror("pee: read");
+
+	if (stats)
+		dump_stats();
+	ret = close_pipes(consumers, nconsumers);
+	if (r < 0)
+		ret |= 1;
+	if (verbose)
+		report(consumers, nconsumers);
+	exit(ret);
 }
@@ -0,0 +1,176 @@
+/* Helpers shared by pee and mispipe, which start commands connected to
+ * them by pipes. Included by both, rather than linked, as each of them
+ * is built from a single source file.
+ *
+ * Licensed under the GPL
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+extern char **environ;
+
+/* Parse a size such as 65536, 512k or 4M. Returns 0 if invalid. */
+static size_t
+parse_size(const char *s)
+{
+	char *end;
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(s, &end, 10);
+	if (errno || end == s || *s == '-')
+		return 0;
+	switch (*end) {
+	case 'g': case 'G':
+		v *= 1024;
+		/* fall thru */
+	case 'm': case 'M':
+		v *= 1024;
+		/* fall thru */
+	case 'k': case 'K':
+		v *= 1024;
+		end++;
+	}
+	if (*end || v > (size_t)-1 / 2)
+		return 0;
+	return v;
+}
+
+/* Try to make the pipe behind fd hold at least want bytes. The kernel
+ * caps the size at /proc/sys/fs/pipe-max-size, and may refuse large
+ * sizes once the user's pipe quota is exhausted, so back off until a
+ * size is accepted. Returns the resulting pipe size, or -1 if it cannot
+ * be determined. */
+static int
+grow_pipe(int fd, size_t want)
+{
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	unsigned long max = 0;
+	int cur;
+	FILE *f;
+
+	cur = fcntl(fd, F_GETPIPE_SZ);
+	if (cur < 0)
+		return -1;
+	f = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (f) {
+		if (fscanf(f, "%lu", &max) != 1)
+			max = 0;
+		fclose(f);
+	}
+	if (max && want > max)
+		want = max;
+	if (want > 1U << 30)
+		want = 1U << 30;
+	while (want > (size_t)cur) {
+		if (fcntl(fd, F_SETPIPE_SZ, (int)want) >= 0)
+			return fcntl(fd, F_GETPIPE_SZ);
+		want /= 2;
+	}
+	return cur;
+#else
+	(void)fd;
+	(void)want;
+	return -1;
+#endif
+}
+
+/* Shell builtins, which must go through the shell even where there is
+ * a program of the same name, since that can behave differently (as
+ * with echo -e). */
+static const char *const builtins[] = {
+	".", ":", "alias", "bg", "break", "cd", "command", "continue",
+	"echo", "eval", "exec", "exit", "export", "false", "fc", "fg",
+	"getopts", "hash", "jobs", "kill", "local", "printf", "pwd", "read",
+	"readonly", "return", "set", "shift", "test", "times", "trap",
+	"true", "type", "ulimit", "umask", "unalias", "unset", "wait", NULL
+};
+
+/* Split a command into words if it is a plain list of words that the
+ * shell would not treat specially, and does not name a builtin.
+ * Returns NULL if the shell is needed; otherwise a NULL-terminated argv
+ * pointing into a copy of cmd. */
+static char **
+split_words(const char *cmd)
+{
+	char **words, *copy, *word;
+	size_t n = 0;
+	int i;
+
+	if (strpbrk(cmd, "|&;<>()$`\\\"'*?[]#~=%{}!\n") != NULL)
+		return NULL;
+	copy = strdup(cmd);
+	words = malloc((strlen(cmd) / 2 + 2) * sizeof *words);
+	if (!copy || !words) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (word = strtok(copy, " \t"); word; word = strtok(NULL, " \t"))
+		words[n++] = word;
+	words[n] = NULL;
+	for (i = 0; n > 0 && builtins[i]; i++)
+		if (strcmp(words[0], builtins[i]) == 0)
+			n = 0;
+	if (n == 0) {
+		free(words);
+		free(copy);
+		return NULL;
+	}
+	return words;
+}
+
+/* Start cmd with in and out as its standard input and output, leaving
+ * ours where they are -1, and store its pid. Simple commands are run
+ * directly; anything using shell syntax or naming a shell builtin is
+ * run with /bin/sh -c, as popen() and system() would, and so is a
+ * command that cannot be run directly (one that is not found, say, so
+ * the shell reports it). The command gets the default handling of
+ * SIGINT, SIGQUIT and SIGPIPE, whatever the caller does with them.
+ * Returns 0, or an errno value. */
+static int
+spawn_command(pid_t *pid, const char *cmd, int in, int out)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	char *shell[] = { "sh", "-c", (char *)cmd, NULL };
+	char **words;
+	int err;
+
+	posix_spawn_file_actions_init(&actions);
+	if (in != -1)
+		posix_spawn_file_actions_adddup2(&actions, in, 0);
+	if (out != -1)
+		posix_spawn_file_actions_adddup2(&actions, out, 1);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGQUIT);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	err = ENOENT;
+	words = split_words(cmd);
+	if (words) {
+		err = posix_spawnp(pid, words[0], &actions, &attr,
+				   words, environ);
+		free(words[0]);
+		free(words);
+	}
+	if (err == ENOENT || err == EACCES)
+		err = posix_spawn(pid, "/bin/sh", &actions, &attr,
+				  shell, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return err;
+}